@@ -4,6 +4,7 @@
 #include <boost/lambda/lambda.hpp>
 #include <boost/lexical_cast.hpp>
 
+// <name> <signature> <memory>=<size>[:<pagesize>],... [<fuse>:<bits>[:<safe values>]]... [nopoll]
 const std::string embedded_chipdefs =
 	// lock bits, low fuses, high fuses, extended fuses
 	"atmega48 avr:1e9205 flash=4096:64,eeprom=256:4 cksel:8,9,10,11 sut:12,13 ckout:14 ckdiv8:15 bodlevel:16,17,18 eesave:19"
@@ -40,6 +41,7 @@ void update_chipdef(std::vector<chipdef> const & templates, chipdef & cd)
 		if (cd.signature == templ.signature)
 		{
 			cd.name = templ.name;
+			cd.no_rdy_poll = templ.no_rdy_poll;
 			cd.memories.insert(templ.memories.begin(), templ.memories.end());
 
 			for (std::size_t j = 0; j < templ.fuses.size(); ++j)
@@ -119,6 +121,12 @@ void parse_chipdefs(std::string const & strdefs, std::vector<chipdef> & res)
 
 		for (std::size_t i = 3; i < tokens.size(); ++i)
 		{
+			if (tokens[i] == "nopoll")
+			{
+				def.no_rdy_poll = true;
+				continue;
+			}
+
 			std::vector<std::string> token_parts;
 			boost::algorithm::split(token_parts, tokens[i], _1 == ':');
 
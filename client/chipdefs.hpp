@@ -4,7 +4,9 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <stdint.h>
+#include <boost/lexical_cast.hpp>
 
 extern const std::string embedded_chipdefs;
 
@@ -30,6 +32,15 @@ struct chipdef
 	};
 	
 	std::vector<fuse> fuses;
+
+	// Set for ISP parts that don't implement Poll RDY/BSY,
+	// given as the `nopoll` token.
+	bool no_rdy_poll;
+
+	chipdef()
+		: no_rdy_poll(false)
+	{
+	}
 	
 	template <typename Iter>
 	std::string format_value(Iter first, Iter last) const
@@ -0,0 +1,156 @@
+#ifndef AVRICSP_CLIENT_COMMAND_PARSER_HPP
+#define AVRICSP_CLIENT_COMMAND_PARSER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+class command_parser
+{
+public:
+	enum state_t { bad, ready, simple_command, header, st_data, st_chunked };
+
+	command_parser()
+		: m_state(ready), m_cmd(0), m_cmd_size(0)
+	{
+	}
+
+	void clear()
+	{
+		m_state = ready;
+	}
+
+	uint8_t command() const { return m_cmd; }
+	std::size_t size() const { return m_buffer.size(); }
+
+	uint8_t push_data(uint8_t ch)
+	{
+		switch (m_state)
+		{
+		case ready:
+			if (ch == 0x80)
+			{
+				m_state = header;
+				break;
+			}
+
+			if (ch > 16)
+			{
+				m_buffer.clear();
+				m_cmd = ch;
+				m_state = simple_command;
+				break;
+			}
+
+			m_state = bad;
+			break;
+
+		case simple_command:
+			m_state = bad;
+			break;
+
+		case header:
+			m_cmd = ch >> 4;
+			if (m_cmd == 0x0f)
+			{
+				m_cmd = ch & 0x0f;
+				m_state = st_chunked;
+				m_remaining_chunk_length = 0;
+				m_buffer.clear();
+			}
+			else
+			{
+				m_cmd_size = ch & 0x0f;
+				m_buffer.clear();
+				m_state = m_cmd_size == 0? ready: st_data;
+			}
+			break;
+
+		case st_data:
+			m_buffer.push_back(ch);
+			m_state = m_cmd_size == m_buffer.size()? ready: st_data;
+			break;
+			
+		case st_chunked:
+			if (m_remaining_chunk_length == 0)
+			{
+				if (ch == 0)
+					m_state = ready;
+				else
+					m_remaining_chunk_length = ch;
+			}
+			else
+			{
+				m_buffer.push_back(ch);
+				--m_remaining_chunk_length;
+			}
+			break;
+
+		default:
+			;
+		}
+
+		if (m_state == bad)
+			return 254;
+
+		if (m_state == simple_command || m_state == ready)
+			return m_cmd;
+
+		return 255;
+	}
+
+	// Consumes bytes from [first, last) until a complete command is
+	// parsed or an error is detected. Stores the result as `push_data`
+	// would return it into `res` and returns the position just past
+	// the last consumed byte.
+	uint8_t const * push_data(uint8_t const * first, uint8_t const * last, uint8_t & res)
+	{
+		res = 255;
+		while (first != last)
+		{
+			if (m_state == st_data)
+			{
+				std::size_t chunk = (std::min)((std::size_t)(last - first), (std::size_t)(m_cmd_size - m_buffer.size()));
+				m_buffer.insert(m_buffer.end(), first, first + chunk);
+				first += chunk;
+				if (m_buffer.size() != m_cmd_size)
+					continue;
+
+				m_state = ready;
+				res = m_cmd;
+				break;
+			}
+
+			if (m_state == st_chunked && m_remaining_chunk_length != 0)
+			{
+				std::size_t chunk = (std::min)((std::size_t)(last - first), (std::size_t)m_remaining_chunk_length);
+				m_buffer.insert(m_buffer.end(), first, first + chunk);
+				first += chunk;
+				m_remaining_chunk_length -= chunk;
+				continue;
+			}
+
+			res = this->push_data(*first++);
+			if (res != 255)
+				break;
+		}
+
+		return first;
+	}
+
+	state_t state() const { return m_state; }
+	uint8_t const * data() const { return &m_buffer[0]; }
+
+	uint8_t operator[](std::size_t index) const { return m_buffer[index]; }
+
+private:
+	state_t m_state;
+
+	uint8_t m_cmd;
+	uint8_t m_cmd_size;
+
+	std::vector<uint8_t> m_buffer;
+	int m_remaining_chunk_length;
+};
+
+#endif
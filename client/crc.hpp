@@ -0,0 +1,41 @@
+#ifndef AVRICSP_CLIENT_CRC_HPP
+#define AVRICSP_CLIENT_CRC_HPP
+
+#include <stdint.h>
+
+// Equivalent to avr-libc's _crc_ccitt_update, which the firmware
+// uses to hash memory pages.
+inline uint16_t crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= (uint8_t)crc;
+	data ^= (uint8_t)(data << 4);
+	return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+// Equivalent to the 24-bit checksum computed by the XMEGA NVM
+// controller's CRC commands. The flash is consumed one little-endian
+// word at a time, starting from zero.
+inline uint32_t nvm_crc24_update(uint32_t crc, uint16_t word)
+{
+	crc <<= 1;
+	if (crc & 0x1000000)
+		crc ^= 0x80001B;
+	return (crc ^ word) & 0xffffff;
+}
+
+// Returns the NVM checksum of [first, last); an odd trailing byte
+// is padded with 0xff.
+template <typename Iter>
+uint32_t nvm_crc24(Iter first, Iter last)
+{
+	uint32_t crc = 0;
+	while (first != last)
+	{
+		uint16_t word = *first++;
+		word |= (first != last? *first++: 0xff) << 8;
+		crc = nvm_crc24_update(crc, word);
+	}
+	return crc;
+}
+
+#endif
@@ -0,0 +1,312 @@
+#include "ihex.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <boost/format.hpp>
+
+#ifndef WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+hex_parse_error::hex_parse_error(const char * message, int line)
+	: std::runtime_error((boost::format("%s (on line %i).") % message % line).str()), m_line(line)
+{
+}
+
+input_buffer::input_buffer()
+	: m_first(0), m_last(0), m_mapping(0), m_mapping_size(0)
+{
+}
+
+input_buffer::~input_buffer()
+{
+	this->release();
+}
+
+void input_buffer::release()
+{
+#ifndef WIN32
+	if (m_mapping)
+		munmap(m_mapping, m_mapping_size);
+#endif
+	m_mapping = 0;
+	m_mapping_size = 0;
+	m_buffer.clear();
+	m_first = m_last = 0;
+}
+
+void input_buffer::open(std::string const & path)
+{
+	this->release();
+
+#ifndef WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("failed to open the file: " + path);
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void * mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			::close(fd);
+			madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+			m_mapping = mapping;
+			m_mapping_size = st.st_size;
+			m_first = static_cast<uint8_t const *>(mapping);
+			m_last = m_first + st.st_size;
+			return;
+		}
+	}
+	::close(fd);
+#endif
+
+	std::ifstream fin(path.c_str(), std::ios::binary);
+	if (!fin)
+		throw std::runtime_error("failed to open the file: " + path);
+
+	char buf[65536];
+	while (fin.read(buf, sizeof buf) || fin.gcount())
+		m_buffer.insert(m_buffer.end(), buf, buf + fin.gcount());
+
+	m_first = m_buffer.empty()? 0: &m_buffer[0];
+	m_last = m_first + m_buffer.size();
+}
+
+void input_buffer::read_stdin()
+{
+	this->release();
+
+	char buf[65536];
+	std::streamsize r;
+	while ((r = std::cin.rdbuf()->sgetn(buf, sizeof buf)) > 0)
+		m_buffer.insert(m_buffer.end(), buf, buf + r);
+
+	m_first = m_buffer.empty()? 0: &m_buffer[0];
+	m_last = m_first + m_buffer.size();
+}
+
+namespace {
+
+struct hex_digit_table
+{
+	hex_digit_table()
+	{
+		std::fill(values, values + 256, (int16_t)-1);
+		for (int i = 0; i < 10; ++i)
+			values['0' + i] = i;
+		for (int i = 0; i < 6; ++i)
+		{
+			values['a' + i] = 10 + i;
+			values['A' + i] = 10 + i;
+		}
+	}
+
+	int16_t values[256];
+};
+
+hex_digit_table const g_hex_digits;
+
+// Returns the value of the two hex digits at `p`, or a negative
+// number if either of them is not a hex digit.
+inline int decode_hex_byte(uint8_t const * p)
+{
+	return (g_hex_digits.values[p[0]] << 4) | g_hex_digits.values[p[1]];
+}
+
+struct segment_origin
+{
+	uint32_t address;
+	uint32_t end;
+	int line;
+
+	bool operator<(segment_origin const & rhs) const
+	{
+		return address < rhs.address;
+	}
+};
+
+}
+
+void parse_ihex(uint8_t const * first, uint8_t const * last, memory_image & image)
+{
+	std::vector<segment_origin> origins;
+	for (std::size_t i = 0; i < image.size(); ++i)
+	{
+		segment_origin o = { image[i].address, image[i].end(), 0 };
+		origins.push_back(o);
+	}
+
+	int line = 1;
+	uint32_t base = 0;
+	memory_segment * current = 0;
+
+	while (first != last)
+	{
+		uint8_t ch = *first;
+		if (ch == '\n')
+		{
+			++line;
+			++first;
+			continue;
+		}
+
+		if (ch == '\r' || ch == ' ' || ch == '\t')
+		{
+			++first;
+			continue;
+		}
+
+		if (ch != ':')
+			throw hex_parse_error("Invalid record start", line);
+		++first;
+
+		if (last - first < 10)
+			throw hex_parse_error("Truncated record", line);
+
+		int length = decode_hex_byte(first);
+		int addr_hi = decode_hex_byte(first + 2);
+		int addr_lo = decode_hex_byte(first + 4);
+		int rectype = decode_hex_byte(first + 6);
+		if ((length | addr_hi | addr_lo | rectype) < 0)
+			throw hex_parse_error("Invalid hex digit", line);
+
+		if (last - first < 2 * (length + 5))
+			throw hex_parse_error("Truncated record", line);
+
+		uint8_t const * data = first + 8;
+		int sum = length + addr_hi + addr_lo + rectype;
+
+		int checksum = decode_hex_byte(data + 2 * length);
+		if (checksum < 0)
+			throw hex_parse_error("Invalid hex digit", line);
+		sum += checksum;
+
+		first += 2 * (length + 5);
+		if (first != last && *first != '\r' && *first != '\n')
+			throw hex_parse_error("Invalid record length specified", line);
+
+		if (rectype == 0 && length != 0)
+		{
+			uint32_t address = base + (addr_hi << 8) + addr_lo;
+			if (!current || current->end() != address)
+			{
+				if (current)
+					origins.back().end = current->end();
+
+				image.push_back(memory_segment());
+				current = &image.back();
+				current->address = address;
+
+				segment_origin o = { address, address, line };
+				origins.push_back(o);
+			}
+
+			std::size_t pos = current->data.size();
+			current->data.resize(pos + length);
+			uint8_t * out = &current->data[0] + pos;
+
+			int bad = 0;
+			for (int i = 0; i < length; ++i, data += 2)
+			{
+				int v = decode_hex_byte(data);
+				bad |= v;
+				sum += v;
+				out[i] = (uint8_t)v;
+			}
+
+			if (bad < 0)
+				throw hex_parse_error("Invalid hex digit", line);
+		}
+		else
+		{
+			uint8_t payload[4];
+			for (int i = 0; i < length; ++i, data += 2)
+			{
+				int v = decode_hex_byte(data);
+				if (v < 0)
+					throw hex_parse_error("Invalid hex digit", line);
+				sum += v;
+				if (i < 4)
+					payload[i] = (uint8_t)v;
+			}
+
+			switch (rectype)
+			{
+			case 0:
+				break;
+			case 1:
+				first = last;
+				break;
+			case 2:
+				if (length != 2)
+					throw hex_parse_error("Invalid type 2 record", line);
+				base = ((payload[0] << 8) + payload[1]) * 16;
+				break;
+			case 4:
+				if (length != 2)
+					throw hex_parse_error("Invalid type 4 record", line);
+				base = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16);
+				break;
+			case 3:
+			case 5:
+				break;
+			default:
+				throw hex_parse_error("Invalid record type", line);
+			}
+		}
+
+		if ((sum & 0xff) != 0)
+			throw hex_parse_error("Checksum mismatch", line);
+	}
+
+	if (current)
+		origins.back().end = current->end();
+
+	std::stable_sort(origins.begin(), origins.end());
+	for (std::size_t i = 1; i < origins.size(); ++i)
+	{
+		if (origins[i].address < origins[i-1].end)
+			throw hex_parse_error("A memory location was defined twice", (std::max)(origins[i].line, origins[i-1].line));
+		if (origins[i].end < origins[i-1].end)
+			origins[i].end = origins[i-1].end;
+	}
+
+	// Sort the segments and merge those that touch.
+	std::vector<std::pair<uint32_t, std::size_t> > order;
+	for (std::size_t i = 0; i < image.size(); ++i)
+		order.push_back(std::make_pair(image[i].address, i));
+	std::sort(order.begin(), order.end());
+
+	memory_image res;
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		memory_segment & seg = image[order[i].second];
+		if (!res.empty() && res.back().end() == seg.address)
+			res.back().data.insert(res.back().data.end(), seg.data.begin(), seg.data.end());
+		else
+		{
+			res.push_back(memory_segment());
+			res.back().address = seg.address;
+			res.back().data.swap(seg.data);
+		}
+	}
+
+	image.swap(res);
+}
+
+std::vector<uint8_t> flatten_image(memory_image const & image)
+{
+	std::vector<uint8_t> res;
+	if (image.empty())
+		return res;
+
+	res.resize(image.back().end(), 0xff);
+	for (std::size_t i = 0; i < image.size(); ++i)
+		std::copy(image[i].data.begin(), image[i].data.end(), res.begin() + image[i].address);
+	return res;
+}
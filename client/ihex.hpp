@@ -0,0 +1,68 @@
+#ifndef AVRICSP_CLIENT_IHEX_HPP
+#define AVRICSP_CLIENT_IHEX_HPP
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+
+struct hex_parse_error
+	: std::runtime_error
+{
+	hex_parse_error(const char * message, int line);
+
+	int line() const { return m_line; };
+
+private:
+	int m_line;
+};
+
+struct memory_segment
+{
+	uint32_t address;
+	std::vector<uint8_t> data;
+
+	uint32_t end() const { return address + data.size(); }
+};
+
+// A sparse memory image, the segments are sorted by address
+// and neither overlap nor touch each other.
+typedef std::vector<memory_segment> memory_image;
+
+// The contents of an input file, memory-mapped where possible.
+class input_buffer
+{
+public:
+	input_buffer();
+	~input_buffer();
+
+	void open(std::string const & path);
+	void read_stdin();
+
+	uint8_t const * begin() const { return m_first; }
+	uint8_t const * end() const { return m_last; }
+
+private:
+	void release();
+
+	uint8_t const * m_first;
+	uint8_t const * m_last;
+	void * m_mapping;
+	std::size_t m_mapping_size;
+	std::vector<uint8_t> m_buffer;
+
+	input_buffer(input_buffer const &);
+	input_buffer & operator=(input_buffer const &);
+};
+
+// Parses Intel HEX records in [first, last) and adds their data
+// to `image`. Supports data (0), end of file (1), extended segment
+// address (2) and extended linear address (4) records; start address
+// records (3, 5) are ignored.
+void parse_ihex(uint8_t const * first, uint8_t const * last, memory_image & image);
+
+// Returns the image as a contiguous block starting at address 0,
+// with holes filled with 0xff.
+std::vector<uint8_t> flatten_image(memory_image const & image);
+
+#endif
@@ -0,0 +1,167 @@
+#include "image_output.hpp"
+#include <stdexcept>
+
+namespace {
+
+struct hex_pair_table
+{
+	hex_pair_table()
+	{
+		static char const digits[] = "0123456789ABCDEF";
+		for (int i = 0; i < 256; ++i)
+		{
+			pairs[2*i] = digits[i >> 4];
+			pairs[2*i+1] = digits[i & 0xf];
+		}
+	}
+
+	char pairs[512];
+};
+
+hex_pair_table const g_hex_pairs;
+
+}
+
+image_output::format_t image_output::parse_format(std::string const & name)
+{
+	if (name == "ihex" || name == "hex")
+		return fmt_ihex;
+	if (name == "srec")
+		return fmt_srec;
+	if (name == "bin" || name == "binary")
+		return fmt_binary;
+	throw std::runtime_error("unknown output format: " + name + " (use ihex, srec or bin)");
+}
+
+image_output::image_output(std::ostream & out, format_t format, uint32_t start, uint32_t end)
+	: m_out(out), m_format(format), m_address(start), m_upper_address(0), m_line_size(0)
+{
+	m_buffer.reserve(flush_threshold + 64);
+
+	if (end <= 0x10000)
+		m_srec_addr_size = 2;
+	else if (end <= 0x1000000)
+		m_srec_addr_size = 3;
+	else
+		m_srec_addr_size = 4;
+}
+
+void image_output::operator()(uint8_t const * first, uint8_t const * last)
+{
+	if (m_format == fmt_binary)
+	{
+		m_buffer.insert(m_buffer.end(), first, last);
+		m_address += last - first;
+		if (m_buffer.size() >= flush_threshold)
+			this->flush();
+		return;
+	}
+
+	while (first != last)
+	{
+		m_line[m_line_size++] = *first++;
+
+		// Intel HEX records must not cross a 64k boundary.
+		if (m_line_size == line_size || ((m_address + m_line_size) & 0xffff) == 0)
+			this->emit_line();
+	}
+}
+
+void image_output::close()
+{
+	if (m_line_size)
+		this->emit_line();
+
+	if (m_format == fmt_ihex)
+	{
+		this->emit_ihex_record(1, 0, 0, 0);
+	}
+	else if (m_format == fmt_srec)
+	{
+		// S9, S8 or S7 terminates S1, S2 or S3 records, respectively.
+		this->emit_srec_record('9' + 2 - m_srec_addr_size, 0, m_srec_addr_size, 0, 0);
+	}
+
+	this->flush();
+	m_out.flush();
+}
+
+void image_output::emit_line()
+{
+	if (m_format == fmt_ihex)
+	{
+		uint32_t upper = m_address >> 16;
+		if (upper != m_upper_address)
+		{
+			uint8_t ela[2] = { (uint8_t)(upper >> 8), (uint8_t)upper };
+			this->emit_ihex_record(4, 0, ela, 2);
+			m_upper_address = upper;
+		}
+
+		this->emit_ihex_record(0, (uint16_t)m_address, m_line, m_line_size);
+	}
+	else
+	{
+		this->emit_srec_record('0' + m_srec_addr_size - 1, m_address, m_srec_addr_size, m_line, m_line_size);
+	}
+
+	m_address += m_line_size;
+	m_line_size = 0;
+
+	if (m_buffer.size() >= flush_threshold)
+		this->flush();
+}
+
+void image_output::emit_ihex_record(uint8_t type, uint16_t address, uint8_t const * data, std::size_t size)
+{
+	uint8_t sum = (uint8_t)(size + (address >> 8) + address + type);
+
+	m_buffer.push_back(':');
+	this->put_byte((uint8_t)size);
+	this->put_byte(address >> 8);
+	this->put_byte((uint8_t)address);
+	this->put_byte(type);
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		this->put_byte(data[i]);
+		sum += data[i];
+	}
+	this->put_byte((uint8_t)(0x100 - sum));
+	m_buffer.push_back('\n');
+}
+
+void image_output::emit_srec_record(char type, uint32_t address, uint8_t addr_size, uint8_t const * data, std::size_t size)
+{
+	uint8_t count = (uint8_t)(addr_size + size + 1);
+	uint8_t sum = count;
+
+	m_buffer.push_back('S');
+	m_buffer.push_back(type);
+	this->put_byte(count);
+	for (uint8_t i = addr_size; i != 0; --i)
+	{
+		uint8_t v = (uint8_t)(address >> (8 * (i - 1)));
+		this->put_byte(v);
+		sum += v;
+	}
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		this->put_byte(data[i]);
+		sum += data[i];
+	}
+	this->put_byte((uint8_t)~sum);
+	m_buffer.push_back('\n');
+}
+
+void image_output::put_byte(uint8_t v)
+{
+	m_buffer.push_back(g_hex_pairs.pairs[2*v]);
+	m_buffer.push_back(g_hex_pairs.pairs[2*v+1]);
+}
+
+void image_output::flush()
+{
+	if (!m_buffer.empty())
+		m_out.write(&m_buffer[0], m_buffer.size());
+	m_buffer.clear();
+}
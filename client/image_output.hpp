@@ -0,0 +1,47 @@
+#ifndef AVRICSP_CLIENT_IMAGE_OUTPUT_HPP
+#define AVRICSP_CLIENT_IMAGE_OUTPUT_HPP
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Formats a stream of memory contents into a large buffer
+// and writes it out in big batches.
+class image_output
+{
+public:
+	enum format_t { fmt_ihex, fmt_srec, fmt_binary };
+
+	static format_t parse_format(std::string const & name);
+
+	// `end` is the address just past the last byte that will be written,
+	// it determines the S-record type.
+	image_output(std::ostream & out, format_t format, uint32_t start, uint32_t end);
+
+	void operator()(uint8_t const * first, uint8_t const * last);
+	void close();
+
+private:
+	static std::size_t const line_size = 16;
+	static std::size_t const flush_threshold = 65536;
+
+	void emit_line();
+	void emit_ihex_record(uint8_t type, uint16_t address, uint8_t const * data, std::size_t size);
+	void emit_srec_record(char type, uint32_t address, uint8_t addr_size, uint8_t const * data, std::size_t size);
+	void put_byte(uint8_t v);
+	void flush();
+
+	std::ostream & m_out;
+	format_t m_format;
+	uint32_t m_address;
+	uint32_t m_upper_address;
+	uint8_t m_srec_addr_size;
+
+	uint8_t m_line[line_size];
+	std::size_t m_line_size;
+
+	std::vector<char> m_buffer;
+};
+
+#endif
@@ -5,17 +5,40 @@
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
-class linux_comm
+struct comm_stats
+{
+	comm_stats()
+		: syscalls(0), bytes_read(0), bytes_written(0)
+	{
+	}
+
+	uint64_t syscalls;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+// A buffered serial transport. Incoming data are read in large blocks
+// into the receive buffer, which the client consumes directly through
+// `rx_data`/`rx_size`/`rx_consume`. Outgoing data are coalesced
+// in the transmit buffer and flushed before the transport blocks
+// waiting for a response.
+class comm
 {
 public:
 	typedef uint8_t char_type;
 
-	linux_comm()
-		: f(-1)
+	comm()
+		: f(-1), m_rx_first(0), m_rx_last(0)
 	{
+		m_rx_buffer.resize(rx_buffer_size);
 	}
 
 	void open(std::string const & dev)
@@ -25,17 +48,19 @@ public:
 			throw std::runtime_error("Failed to open the serial port.");
 
 		termios config;
-		tcgetattr(f, &config);
-		config.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
-			INLCR | PARMRK | INPCK | ISTRIP | IXON);
-		config.c_oflag = 0;
-		config.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
-		config.c_cflag = config.c_cflag & ~(CSIZE | PARENB) | CS8;
-		config.c_cc[VMIN]  = 0;
-		config.c_cc[VTIME] = 0;
-		cfsetispeed(&config, B38400);
-		cfsetospeed(&config, B38400);
-		tcsetattr(f, TCSAFLUSH, &config);
+		if (tcgetattr(f, &config) == 0)
+		{
+			config.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
+				INLCR | PARMRK | INPCK | ISTRIP | IXON);
+			config.c_oflag = 0;
+			config.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
+			config.c_cflag = (config.c_cflag & ~(CSIZE | PARENB)) | CS8;
+			config.c_cc[VMIN]  = 0;
+			config.c_cc[VTIME] = 0;
+			cfsetispeed(&config, B38400);
+			cfsetospeed(&config, B38400);
+			tcsetattr(f, TCSAFLUSH, &config);
+		}
 
 		fcntl(f, F_SETFL, fcntl(f, F_GETFL) | O_NONBLOCK);
 
@@ -43,11 +68,11 @@ public:
 		this->f = f;
 	}
 
-	~linux_comm()
+	~comm()
 	{
 		this->close();
 	}
-	
+
 	void close()
 	{
 		if (f != -1)
@@ -55,8 +80,11 @@ public:
 			::close(f);
 			f = -1;
 		}
+
+		m_rx_first = m_rx_last = 0;
+		m_tx_buffer.clear();
 	}
-	
+
 	bool is_open() const
 	{
 		return f != -1;
@@ -64,47 +92,115 @@ public:
 
 	void write(char_type const * first, char_type const * last)
 	{
-		fd_set fs;
-		FD_ZERO(&fs);
+		m_tx_buffer.insert(m_tx_buffer.end(), first, last);
+		if (m_tx_buffer.size() >= tx_flush_threshold)
+			this->flush();
+	}
 
-		while (first != last)
+	void flush()
+	{
+		std::size_t pos = 0;
+		while (pos != m_tx_buffer.size())
 		{
-			FD_SET(f, &fs);
-			select(f + 1, 0, &fs, 0, 0);
-			int written = ::write(f, first, last - first);
+			++m_stats.syscalls;
+			ssize_t written = ::write(f, &m_tx_buffer[pos], m_tx_buffer.size() - pos);
 			if (written < 0)
-				throw std::runtime_error("Failed to write into the serial port.");
-			first += written;
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					throw std::runtime_error("Failed to write into the serial port.");
+
+				this->wait_for(POLLOUT, -1);
+				continue;
+			}
+
+			pos += written;
+			m_stats.bytes_written += written;
 		}
+
+		m_tx_buffer.clear();
 	}
 
-	char_type * read(char_type * first, char_type * last, int microsecs = 0)
+	char_type const * rx_data() const
+	{
+		return &m_rx_buffer[m_rx_first];
+	}
+
+	std::size_t rx_size() const
+	{
+		return m_rx_last - m_rx_first;
+	}
+
+	void rx_consume(std::size_t size)
+	{
+		m_rx_first += size;
+		if (m_rx_first == m_rx_last)
+			m_rx_first = m_rx_last = 0;
+	}
+
+	// Flushes the transmit buffer and waits until at least one more byte
+	// is available in the receive buffer. Returns false if nothing
+	// arrives within `millisecs` (negative means no timeout).
+	bool rx_fill(int millisecs = -1)
 	{
-		fd_set fs;
-		FD_ZERO(&fs);
+		this->flush();
+
+		if (m_rx_first != 0)
+		{
+			std::copy(m_rx_buffer.begin() + m_rx_first, m_rx_buffer.begin() + m_rx_last, m_rx_buffer.begin());
+			m_rx_last -= m_rx_first;
+			m_rx_first = 0;
+		}
+
+		if (m_rx_last == m_rx_buffer.size())
+			return true;
 
-		do
+		uint64_t deadline = millisecs < 0? 0: now_ms() + millisecs;
+		for (;;)
 		{
-			FD_SET(f, &fs);
-			if (microsecs != 0)
+			++m_stats.syscalls;
+			ssize_t r = ::read(f, &m_rx_buffer[m_rx_last], m_rx_buffer.size() - m_rx_last);
+			if (r > 0)
 			{
-				timeval timeout = { 0, microsecs };
-				if (select(f + 1, &fs, 0, 0, &timeout) < 1)
-					break;
+				m_rx_last += r;
+				m_stats.bytes_read += r;
+				return true;
 			}
-			else
-				select(f + 1, &fs, 0, 0, 0);
 
-			int r = ::read(f, first, last - first);
-			if (r < 0)
+			if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
 				throw std::runtime_error("failed to read from the serial port");
-			first += r;
+
+			int timeout = -1;
+			if (millisecs >= 0)
+			{
+				uint64_t t = now_ms();
+				if (t >= deadline)
+					return false;
+				timeout = (int)(deadline - t);
+			}
+
+			if (!this->wait_for(POLLIN, timeout))
+				return false;
+		}
+	}
+
+	char_type * read(char_type * first, char_type * last, int microsecs = 0)
+	{
+		while (first != last)
+		{
+			if (this->rx_size() == 0 && !this->rx_fill(microsecs == 0? -1: (microsecs + 999) / 1000))
+				break;
+
+			std::size_t chunk = (std::min)(this->rx_size(), (std::size_t)(last - first));
+			std::copy(this->rx_data(), this->rx_data() + chunk, first);
+			this->rx_consume(chunk);
+			first += chunk;
 		}
-		while (first != last);
 
 		return first;
 	}
-	
+
 	char_type read()
 	{
 		char_type r;
@@ -115,13 +211,58 @@ public:
 	void rx_clear()
 	{
 		tcflush(f, TCIFLUSH);
+		m_rx_first = m_rx_last = 0;
+	}
+
+	comm_stats const & stats() const
+	{
+		return m_stats;
 	}
 
 private:
+	static const std::size_t rx_buffer_size = 16384;
+	static const std::size_t tx_flush_threshold = 4096;
+
+	static uint64_t now_ms()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	bool wait_for(short events, int timeout)
+	{
+		pollfd pfd = { f, events, 0 };
+		for (;;)
+		{
+			++m_stats.syscalls;
+			int r = ::poll(&pfd, 1, timeout);
+			if (r > 0)
+			{
+				if (pfd.revents & (POLLERR | POLLNVAL))
+					throw std::runtime_error("the serial port failed");
+				return true;
+			}
+
+			if (r == 0)
+				return false;
+			if (errno != EINTR)
+				throw std::runtime_error("failed to wait for the serial port");
+		}
+	}
+
 	int f;
-	
-	linux_comm(linux_comm const &);
-	linux_comm & operator=(linux_comm const &);
+
+	std::vector<char_type> m_rx_buffer;
+	std::size_t m_rx_first;
+	std::size_t m_rx_last;
+
+	std::vector<char_type> m_tx_buffer;
+
+	comm_stats m_stats;
+
+	comm(comm const &);
+	comm & operator=(comm const &);
 };
 
-#endif
\ No newline at end of file
+#endif
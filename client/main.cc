@@ -6,162 +6,61 @@
 
 #include <iostream>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <iomanip>
 #include <vector>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
 #include <fstream>
+#include <deque>
+#include <algorithm>
 
-#include "chipdefs.hpp"
-
-struct hex_parse_error
-	: std::runtime_error
-{
-	hex_parse_error(const char * message, int line)
-		: std::runtime_error(format_message(message, line)), m_line(line)
-	{
-	}
-
-	int line() const { return m_line; };
-
-private:
-	std::string format_message(const char * message, int line)
-	{
-		return (boost::format("%s (on line %i).") % message % line).str();
-	}
+#ifdef WIN32
+# include <io.h>
+# include <fcntl.h>
+#else
+# include <sys/time.h>
+#endif
 
-	int m_line;
-};
+#include "chipdefs.hpp"
+#include "command_parser.hpp"
+#include "crc.hpp"
+#include "ihex.hpp"
+#include "image_output.hpp"
 
-class command_parser
+class stopwatch
 {
 public:
-	enum state_t { bad, ready, simple_command, header, st_data, st_chunked };
-
-	command_parser()
-		: m_state(ready), m_cmd(0), m_cmd_size(0)
+	stopwatch()
+		: m_start(now())
 	{
 	}
 
-	void clear()
+	void restart()
 	{
-		m_state = ready;
+		m_start = now();
 	}
 
-	uint8_t command() const { return m_cmd; }
-	uint8_t size() const { return m_buffer.size(); }
-
-	uint8_t push_data(uint8_t ch)
+	double elapsed() const
 	{
-		switch (m_state)
-		{
-		case ready:
-			if (ch == 0x80)
-			{
-				m_state = header;
-				break;
-			}
-
-			if (ch > 16)
-			{
-				m_buffer.clear();
-				m_cmd = ch;
-				m_state = simple_command;
-				break;
-			}
-
-			m_state = bad;
-			break;
-
-		case simple_command:
-			m_state = bad;
-			break;
-
-		case header:
-			m_cmd = ch >> 4;
-			if (m_cmd == 0x0f)
-			{
-				m_cmd = ch & 0x0f;
-				m_state = st_chunked;
-				m_remaining_chunk_length = 0;
-				m_buffer.clear();
-			}
-			else
-			{
-				m_cmd_size = ch & 0x0f;
-				m_buffer.clear();
-				m_state = m_cmd_size == 0? ready: st_data;
-			}
-			break;
-
-		case st_data:
-			m_buffer.push_back(ch);
-			m_state = m_cmd_size == m_buffer.size()? ready: st_data;
-			break;
-			
-		case st_chunked:
-			if (m_remaining_chunk_length == 0)
-			{
-				if (ch == 0)
-					m_state = ready;
-				else
-					m_remaining_chunk_length = ch;
-			}
-			else
-			{
-				m_buffer.push_back(ch);
-				--m_remaining_chunk_length;
-			}
-			break;
-
-		default:
-			;
-		}
-
-		if (m_state == bad)
-			return 254;
-
-		if (m_state == simple_command || m_state == ready)
-			return m_cmd;
-
-		return 255;
+		return now() - m_start;
 	}
 
-	state_t state() const { return m_state; }
-	uint8_t const * data() const { return &m_buffer[0]; }
-
-	uint8_t operator[](uint8_t index) const { return m_buffer[index]; }
-
 private:
-	state_t m_state;
-
-	uint8_t m_cmd;
-	uint8_t m_cmd_size;
+	static double now()
+	{
+#ifdef WIN32
+		return GetTickCount() / 1000.0;
+#else
+		timeval tv;
+		gettimeofday(&tv, 0);
+		return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+	}
 
-	std::vector<uint8_t> m_buffer;
-	int m_remaining_chunk_length;
+	double m_start;
 };
 
-void print_hex_line(int address, uint8_t const * data, int length)
-{
-	uint8_t line[21];
-	line[0] = length;
-	line[1] = address >> 8;
-	line[2] = address;
-	line[3] = 0;
-	for (int j = 0; j < length; ++j)
-		line[j+4] = data[j];
-	int sum = 0;
-	for (int j = 0; j < length + 4; ++j)
-		sum += line[j];
-	line[length + 4] = 0x100 - (sum & 0xff);
-
-	std::cout << ':';
-	for (int j = 0; j < length + 5; ++j)
-		std::cout << std::hex << std::setw(2) << std::setfill('0') << std::uppercase << (int)line[j];
-	std::cout << std::endl;
-}
-
 chipdef const * find_chipdef(uint32_t signature, std::vector<chipdef> const & chipdefs)
 {
 	std::string strsig = (boost::format("avr:%0.6x") % signature).str();
@@ -175,37 +74,6 @@ chipdef const * find_chipdef(uint32_t signature, std::vector<chipdef> const & ch
 	return 0;
 }
 
-struct hex_output
-{
-	explicit hex_output(int out_address)
-		: out_address(out_address)
-	{
-	}
-
-	template <typename Iter>
-	void operator()(Iter first, Iter last)
-	{
-		buf.insert(buf.end(), first, last);
-				
-		while (buf.size() > 16)
-		{
-			print_hex_line(out_address, &buf[0], 16);
-			out_address += 16;
-			buf.erase(buf.begin(), buf.begin() + 16);
-		}
-	}
-
-	void close()
-	{
-		print_hex_line(out_address, &buf[0], buf.size());
-		buf.clear();
-		std::cout << ":00000001FF" << std::endl;
-	}
-
-	int out_address;
-	std::vector<uint8_t> buf;
-};
-
 template <typename Container>
 struct appender_functor
 {
@@ -232,7 +100,9 @@ appender_functor<Container> appender(Container & c)
 struct app
 {
 	app()
-		: m_no_more_commands(false), m_programming_mode(false)
+		: m_no_more_commands(false), m_programming_mode(false), m_flash_erased(false),
+		m_read_window(4), m_read_chunk(127), m_max_in_payload(15),
+		m_write_window(0), m_max_out_payload(15), m_device_flags(0), m_device_commands(0)
 	{
 	}
 	
@@ -252,23 +122,43 @@ struct app
 	}
 	
 	void receive_packet(int command)
+	{
+		if (this->receive_any_packet() != command)
+			throw std::runtime_error("received invalid command");
+	}
+
+	// Receives a packet of the reply to `op` of command 15, which starts
+	// with the op and the error code. Returns the error code.
+	uint8_t receive_ext_packet(uint8_t op)
+	{
+		receive_packet(15);
+		if (cmd_parser.size() < 2 || cmd_parser[0] != op)
+			throw std::runtime_error("error: corrupted response from the programmer");
+		return cmd_parser[1];
+	}
+
+	// Receives the next packet and returns its command.
+	uint8_t receive_any_packet()
 	{
 		for (;;)
 		{
-			uint8_t cmd = cmd_parser.push_data(lc.read());
+			if (lc.rx_size() == 0 && !lc.rx_fill(receive_timeout_ms))
+				throw std::runtime_error("the programmer did not respond in time");
+
+			uint8_t cmd;
+			uint8_t const * first = lc.rx_data();
+			lc.rx_consume(cmd_parser.push_data(first, first + lc.rx_size(), cmd) - first);
 			if (cmd == 254)
 			{
 				cmd_parser.clear();
 				continue;
 			}
 	
-			if (cmd == 255 || cmd == 0xe)
+			// shupito23 reports its button on 12 whenever it's pressed.
+			if (cmd == 255 || cmd == 0xc || cmd == 0xe)
 				continue;
-	
-			if (cmd != command)
-				throw std::runtime_error("received invalid command");
-	
-			break;
+
+			return cmd;
 		}
 	}
 	
@@ -280,16 +170,136 @@ struct app
 		if (m_current_mode != 0x871e0846 && m_current_mode != 0xc2a4dd67)
 			throw std::runtime_error("error: you must select the programming interface (use the :mode command)");
 
-		send_packet(0x10);
+		if (m_current_mode == 0x871e0846)
+		{
+			// The programmer polls an ISP part for the end of each NVM
+			// operation. Parts that can't be polled must be entered again
+			// for it to wait the worst-case times instead.
+			int khz = this->enter_isp_mode(false);
+			m_programming_mode = true;
+			this->read_chip_def(m_cd2);
+			if (m_cd2.no_rdy_poll)
+			{
+				send_packet(0x20);
+				receive_packet(2);
+				m_programming_mode = false;
+				khz = this->enter_isp_mode(true);
+				m_programming_mode = true;
+			}
+
+			if (khz)
+				std::cerr << "isp clock: " << khz << " kHz" << std::endl;
+			return;
+		}
+
+		if ((m_device_flags & 0x08) == 0)
+		{
+			send_packet(0x10);
+			check_programming_mode(this->receive_progen());
+			m_programming_mode = true;
+			return;
+		}
+
+		// The programmer can find the fastest PDI clock the chip follows.
+		// The clock found for a chip is cached under its signature, which
+		// is read at the default clock first, so that a cached clock is
+		// only ever tried on the chip it was found for.
+		send_packet(0x12, pdi_safe_bsel & 0xff, pdi_safe_bsel >> 8);
+		check_programming_mode(this->receive_progen());
+		m_programming_mode = true;
+		this->read_chip_def(m_cd2);
+		std::string signature = m_cd2.signature;
+
+		std::vector<std::pair<std::string, uint16_t> > clocks = load_pdi_clocks();
+		std::vector<std::pair<std::string, uint16_t> >::iterator cached
+			= std::find_if(clocks.begin(), clocks.end(), signature_is(signature));
+		for (;;)
+		{
+			send_packet(0x20);
+			receive_packet(2);
+			m_programming_mode = false;
+			m_cd2.signature.clear();
+
+			uint16_t bsel = cached != clocks.end()? cached->second: 0xffff;
+			send_packet(0x12, bsel & 0xff, bsel >> 8);
+			uint8_t error = this->receive_progen();
+
+			// 1'error 2'bsel 2'khz
+			int khz = 0;
+			if (!error && cmd_parser.size() >= 5)
+			{
+				bsel = cmd_parser[1] | (cmd_parser[2] << 8);
+				khz = cmd_parser[3] | (cmd_parser[4] << 8);
+			}
+
+			if (!error)
+				m_programming_mode = true;
+			bool read_ok = !error && this->try_read_chip_def(m_cd2) && m_cd2.signature == signature;
+
+			if (!read_ok && cached != clocks.end())
+			{
+				// The cached clock no longer works for the chip,
+				// it's searched for again.
+				clocks.erase(cached);
+				save_pdi_clocks(clocks);
+				cached = clocks.end();
+				continue;
+			}
+
+			check_programming_mode(error);
+			if (!read_ok)
+				throw std::runtime_error("failed to read chip signature");
+
+			// An older programmer doesn't report the clock it chose.
+			if (khz)
+			{
+				std::cerr << "pdi clock: " << khz << " kHz" << std::endl;
+				if (cached == clocks.end())
+				{
+					clocks.push_back(std::make_pair(signature, bsel));
+					save_pdi_clocks(clocks);
+				}
+			}
+			break;
+		}
+	}
+
+	// Enters the ISP programming mode. A programmer that can find
+	// the fastest SPI clock the part follows is asked to, the clock
+	// is then returned in kHz. If `no_poll` is set, the programmer
+	// waits the worst-case times instead of polling the part.
+	int enter_isp_mode(bool no_poll)
+	{
+		uint16_t bsel = (m_device_flags & 0x20) != 0? 0xffff: isp_nopoll_bsel;
+		if (no_poll)
+			send_packet(0x13, bsel & 0xff, bsel >> 8, 0x01);
+		else if (bsel == 0xffff)
+			send_packet(0x12, bsel & 0xff, bsel >> 8);
+		else
+			send_packet(0x10);
+		check_programming_mode(this->receive_progen());
+
+		// 1'error 2'bsel 2'khz
+		if (bsel == 0xffff && cmd_parser.size() >= 5)
+			return cmd_parser[3] | (cmd_parser[4] << 8);
+		return 0;
+	}
+
+	// Receives the response to PROGEN, which starts with an error code.
+	uint8_t receive_progen()
+	{
 		receive_packet(1);
 		if (cmd_parser.size() < 1)
 			throw std::runtime_error("error: corrupted response from the programmer\n"
 				"failed to initialize the programming mode");
-		
-		switch (cmd_parser[0])
+		return cmd_parser[0];
+	}
+
+	static void check_programming_mode(uint8_t error)
+	{
+		switch (error)
 		{
 		case 0:
-			m_programming_mode = true;
 			break;
 		case 1:
 			throw std::runtime_error("warning: the chip didn't respond, failed to initialize the programming mode");
@@ -300,6 +310,46 @@ struct app
 		}
 	}
 
+	// Asks for the programmer's capabilities and the current function.
+	// The capabilities are requested first, so that a programmer
+	// which doesn't know that request is recognized by answering
+	// only the second one.
+	void read_current_mode()
+	{
+		send_packet(0x01, 0x05);
+		send_packet(0x01, 0x04);
+
+		receive_packet(0);
+		if (cmd_parser.size() == 6 && cmd_parser[0] == 0x45)
+		{
+			// 1'max_in 1'max_out 1'flags 2'commands
+			m_max_in_payload = (std::max)((int)cmd_parser[1], 1);
+			// Only a programmer that accepts long payloads reads the link
+			// fast enough to take several pages without acknowledging them.
+			if ((cmd_parser[3] & 0x01) != 0)
+			{
+				m_max_out_payload = (std::max)((int)cmd_parser[2], 2);
+				m_write_window = 2;
+			}
+			m_device_flags = cmd_parser[3];
+			m_device_commands = cmd_parser[4] | (cmd_parser[5] << 8);
+			m_read_chunk = 8 * m_max_in_payload - 1;
+			receive_packet(0);
+		}
+
+		if (cmd_parser.size() != 5 || cmd_parser[0] != 0x44)
+			throw std::runtime_error("Invalid response.");
+
+		m_current_mode = cmd_parser[1] | (cmd_parser[2] << 8) | (cmd_parser[3] << 16) | (cmd_parser[4] << 24);
+	}
+
+	// Returns false if the programmer advertised its commands
+	// and `cmd` is not among them.
+	bool supports_command(int cmd) const
+	{
+		return m_device_commands == 0 || (m_device_commands & (1 << cmd)) != 0;
+	}
+
 	void print_mode(uint32_t mode)
 	{
 		switch (mode)
@@ -351,13 +401,7 @@ struct app
 			m_modes[fn] = i / 4 + 1;
 		}
 
-		// Get the current function.
-		send_packet(0x01, 0x04);
-		receive_packet(0);
-		if (cmd_parser.size() != 5 || cmd_parser[0] != 0x44)
-			throw std::runtime_error("Invalid response.");
-
-		m_current_mode = cmd_parser[1] | (cmd_parser[2] << 8) | (cmd_parser[3] << 16) | (cmd_parser[4] << 24);
+		this->read_current_mode();
 		this->print_mode(m_current_mode);
 		m_id.assign(cmd_parser.data(), cmd_parser.data() + 4);
 
@@ -435,69 +479,397 @@ struct app
 		}
 	}
 
+	// The programmer splits the response to a READ into packets
+	// of at most `m_max_in_payload` bytes and terminates a response
+	// whose length is a multiple of that size with an empty packet.
+	// Requests are sized so that the terminator is never sent, which lets
+	// the responses to several outstanding requests be told apart
+	// just by counting bytes.
+	uint32_t read_chunk_size(uint32_t remaining) const
+	{
+		uint32_t chunk = (std::min)(remaining, m_read_chunk);
+		if (chunk > 1 && chunk % m_max_in_payload == 0)
+			--chunk;
+		return chunk;
+	}
+
+	void send_read_request(int memid, uint32_t base, uint32_t chunk)
+	{
+		send_packet(0x47, memid, base, base >> 8, base >> 16, base >> 24, chunk, chunk >> 8);
+	}
+
+	// Reads `length` bytes starting at `start`, keeping up to `m_read_window`
+	// READ requests in flight. Responses arrive in the order in which
+	// the requests were sent and are passed to `buf` as they come.
 	template <typename Appendable>
 	void read_memory(int memid, int start, int length, Appendable & buf)
 	{
-		int processed = 0;
-		while (processed < length)
+		// The fuses come in a single packet without a terminator,
+		// holding only the bytes the programmer knows of, so they
+		// can't be counted on. They're read with one request instead.
+		if (memid == 3)
+		{
+			if (length > 0)
+			{
+				this->send_read_request(memid, start, length);
+				receive_packet(4);
+				buf(cmd_parser.data(), cmd_parser.data() + (std::min)(cmd_parser.size(), (std::size_t)length));
+			}
+			return;
+		}
+
+		std::deque<uint32_t> outstanding;
+		uint32_t requested = 0;
+		uint32_t received = 0;
+
+		while (requested < (uint32_t)length || !outstanding.empty())
 		{
-			uint32_t chunk = length - processed;
-			if (chunk > 127)
-				chunk = 127;
+			while (requested < (uint32_t)length && outstanding.size() < m_read_window)
+			{
+				uint32_t chunk = this->read_chunk_size(length - requested);
+				this->send_read_request(memid, start + requested, chunk);
+				outstanding.push_back(chunk);
+				requested += chunk;
+			}
 
-			uint32_t base = start + processed;
-			send_packet(0x46, memid, base, base >> 8, base >> 16, base >> 24, chunk);
 			receive_packet(4);
 			buf(cmd_parser.data(), cmd_parser.data() + cmd_parser.size());
 
-			processed += chunk;
+			received += cmd_parser.size();
+			while (!outstanding.empty() && received >= outstanding.front())
+			{
+				received -= outstanding.front();
+				outstanding.pop_front();
+			}
+		}
+	}
+
+	template <typename Appendable>
+	void read_memory_timed(int memid, int start, int length, Appendable & buf)
+	{
+		stopwatch sw;
+		comm_stats base_stats = lc.stats();
+		this->read_memory(memid, start, length, buf);
+		double elapsed = sw.elapsed();
+		uint64_t syscalls = lc.stats().syscalls - base_stats.syscalls;
+
+		std::cerr << "read " << std::dec << length << " bytes in "
+			<< std::fixed << std::setprecision(3) << elapsed << " s";
+		if (elapsed > 0)
+			std::cerr << " (" << std::setprecision(0) << length / elapsed << " B/s)";
+		if (length > 0)
+			std::cerr << ", " << std::setprecision(1) << syscalls * 1024.0 / length << " syscalls/KB";
+		std::cerr << std::endl;
+	}
+
+	// Sends a packet of arbitrary length. Packets that don't fit
+	// into the 15-byte simple frame use the chunked framing,
+	// i.e. 0x80 0xF<cmd> (<len> <data>*)* 0.
+	void send_frame(uint8_t cmd, uint8_t const * first, uint8_t const * last)
+	{
+		std::vector<uint8_t> frame;
+		frame.push_back(0x80);
+
+		// Command 15 has no simple frame.
+		if (last - first <= 15 && cmd != 15)
+		{
+			frame.push_back((cmd << 4) | (last - first));
+			frame.insert(frame.end(), first, last);
+		}
+		else
+		{
+			frame.push_back(0xf0 | cmd);
+			while (first != last)
+			{
+				uint8_t chunk = (uint8_t)(std::min)(last - first, (std::ptrdiff_t)255);
+				frame.push_back(chunk);
+				frame.insert(frame.end(), first, first + chunk);
+				first += chunk;
+			}
+			frame.push_back(0);
 		}
+
+		lc.write(&frame[0], &frame[0] + frame.size());
 	}
 
+	// Waits for the acknowledgements of all but the last `keep`
+	// commands that were sent without waiting for a response.
+	// On a failure, the remaining acknowledgements are consumed
+	// before the error is reported.
+	void receive_acks(std::size_t keep = 0)
+	{
+		std::string error;
+		while (m_pending_acks.size() > (error.empty()? keep: 0))
+		{
+			uint8_t cmd = m_pending_acks.front().first;
+			uint32_t addr = m_pending_acks.front().second;
+			m_pending_acks.pop_front();
+
+			this->receive_packet(cmd);
+			if (!error.empty())
+				continue;
+
+			if (cmd == 8 && cmd_parser.size() == 3 && cmd_parser[0] == 6)
+			{
+				error = (boost::format("verify failed at address 0x%x")
+					% (addr + (cmd_parser[1] | (cmd_parser[2] << 8)))).str();
+			}
+			else if (cmd_parser.size() >= 1 && cmd_parser[0] != 0)
+			{
+				error = (boost::format("the programmer failed to write the memory (command %d, error %d)")
+					% (int)cmd % (int)cmd_parser[0]).str();
+			}
+		}
+
+		if (!error.empty())
+			throw std::runtime_error(error);
+	}
+
+	// Queues WPREP, WFILL and WRITE for a single page without waiting
+	// for the programmer's acknowledgements. Returns the number of
+	// acknowledgements the page will generate.
 	template <typename Iter>
-	void write_mempage(int memid, int start, Iter first, Iter last)
+	std::size_t write_mempage(chipdef::memorydef const & md, int start, Iter first, Iter last, bool blank = false,
+		bool async = false, bool verify = false)
 	{
-		this->send_packet(0x65, memid, start, start >> 8, start >> 16, start >> 24);
-		this->receive_packet(6);
+		int memid = md.memid;
 
-		uint8_t packet[18];
-		packet[0] = 0x80;
-		packet[2] = memid;
+		// An ISP programmer writes EEPROM by pages if it knows their size.
+		if (memid == 2 && md.pagesize != 0)
+			this->send_packet(0x67, memid, start, start >> 8, start >> 16, start >> 24, (int)md.pagesize, (int)md.pagesize >> 8);
+		else
+			this->send_packet(0x65, memid, start, start >> 8, start >> 16, start >> 24);
+		m_pending_acks.push_back(std::make_pair(6, start));
+		std::size_t acks = this->receive_unwindowed_acks(1);
+
+		std::vector<uint8_t> payload;
+		payload.reserve(m_max_out_payload);
 		while (first != last)
 		{
-			int chunk = (std::min)(last - first, 14);
+			payload.clear();
+			payload.push_back(memid);
+			while (first != last && payload.size() < m_max_out_payload)
+				payload.push_back(*first++);
+
+			this->send_frame(7, &payload[0], &payload[0] + payload.size());
+			m_pending_acks.push_back(std::make_pair(7, start));
+			acks += this->receive_unwindowed_acks(1);
+		}
 
-			packet[1] = 0x70 | (chunk + 1);
+		// A page known to be blank can be written without erasing it first.
+		// An asynchronous write is acknowledged right away, its failure
+		// is reported on a later command. A verified write reads the page
+		// back before it is acknowledged.
+		int flags = 0;
+		if (blank && (m_device_flags & 0x02) != 0)
+			flags |= 0x01;
+		if (async && (m_device_flags & 0x04) != 0)
+			flags |= 0x02;
+		if (verify && this->can_verify_writes())
+			flags |= 0x04;
+
+		if (flags)
+			this->send_packet(0x86, memid, start, start >> 8, start >> 16, start >> 24, flags);
+		else
+			this->send_packet(0x85, memid, start, start >> 8, start >> 16, start >> 24);
+		m_pending_acks.push_back(std::make_pair(8, start));
+		return acks + this->receive_unwindowed_acks(1);
+	}
 
-			for (int i = 0; i < chunk; ++i)
-				packet[i+3] = *first++;
+	// A programmer without a write window has no room for more than
+	// a single command, each one is acknowledged before the next is sent.
+	// Returns the number of acknowledgements still pending.
+	std::size_t receive_unwindowed_acks(std::size_t acks)
+	{
+		if (m_write_window != 0)
+			return acks;
+		this->receive_acks();
+		return 0;
+	}
 
-			lc.write(packet, packet + chunk + 3);
-			this->receive_packet(7);
+	bool can_verify_writes() const
+	{
+		return (m_device_flags & 0x10) != 0;
+	}
+
+	// Returns the CRC-16/CCITT of every `pagesize`-byte page
+	// in [start, start + length), as computed by the programmer.
+	std::vector<uint16_t> read_page_hashes(int memid, uint32_t start, uint32_t length, uint32_t pagesize)
+	{
+		std::vector<uint16_t> res;
+		uint32_t pages = (length + pagesize - 1) / pagesize;
+		while (res.size() < pages)
+		{
+			uint32_t batch = (std::min)(pages - (uint32_t)res.size(), (uint32_t)64);
+
+			uint32_t addr = start + res.size() * pagesize;
+			uint32_t len = batch * pagesize;
+			uint8_t const req[] = { 0, (uint8_t)memid,
+				(uint8_t)addr, (uint8_t)(addr >> 8), (uint8_t)(addr >> 16), (uint8_t)(addr >> 24),
+				(uint8_t)len, (uint8_t)(len >> 8), (uint8_t)(len >> 16), (uint8_t)(len >> 24),
+				(uint8_t)pagesize, (uint8_t)(pagesize >> 8) };
+			this->send_frame(15, req, req + sizeof req);
+
+			std::vector<uint8_t> hashes;
+			while (hashes.size() < batch * 2)
+			{
+				if (this->receive_ext_packet(0) != 0)
+					throw std::runtime_error("error: the programmer failed to hash the memory");
+				hashes.insert(hashes.end(), cmd_parser.data() + 2, cmd_parser.data() + cmd_parser.size());
+			}
+
+			for (uint32_t i = 0; i < batch; ++i)
+				res.push_back(hashes[2*i] | (hashes[2*i+1] << 8));
+		}
+
+		return res;
+	}
+
+	// Marks the pages of [first, last) whose contents already match
+	// the device's memory.
+	template <typename Iter>
+	std::vector<bool> find_unchanged_pages(chipdef::memorydef const & md, uint32_t pagesize, int start, Iter first, Iter last)
+	{
+		std::vector<uint16_t> hashes = this->read_page_hashes(md.memid, start, last - first, pagesize);
+
+		std::vector<bool> res;
+		for (std::size_t i = 0; i < hashes.size(); ++i)
+		{
+			uint16_t crc = 0xffff;
+			for (std::size_t j = 0; j < pagesize; ++j)
+				crc = crc_ccitt_update(crc, first != last? *first++: 0xff);
+			res.push_back(crc == hashes[i]);
 		}
 
-		this->send_packet(0x85, memid, start, start >> 8, start >> 16, start >> 24);
-		this->receive_packet(8);
+		return res;
 	}
 
+	// Returns the checksum the XMEGA's NVM controller computes
+	// over the flash range [start, start + length).
+	uint32_t read_flash_crc(uint32_t start, uint32_t length)
+	{
+		uint8_t const req[] = { 1, 1,
+			(uint8_t)start, (uint8_t)(start >> 8), (uint8_t)(start >> 16), (uint8_t)(start >> 24),
+			(uint8_t)length, (uint8_t)(length >> 8), (uint8_t)(length >> 16), (uint8_t)(length >> 24) };
+		this->send_frame(15, req, req + sizeof req);
+		if (this->receive_ext_packet(1) != 0)
+			throw std::runtime_error("error: the programmer failed to compute the checksum");
+		if (cmd_parser.size() != 5)
+			throw std::runtime_error("error: corrupted response from the programmer");
+		return cmd_parser[2] | (cmd_parser[3] << 8) | ((uint32_t)cmd_parser[4] << 16);
+	}
+
+	// Writes the memory page by page, keeping up to `m_write_window`
+	// pages in flight so that the transfer of the next page overlaps
+	// the programming of the previous one. Without a window, every
+	// command is acknowledged before the next one is sent. If `erased` is set, the pages
+	// are known to be blank and the programmer need not erase them.
+	// If `verify` is set, the programmer compares each page with
+	// the data written, see `can_verify_writes`.
 	template <typename Iter>
-	void write_memory(chipdef::memorydef const & md, int start, Iter first, Iter last)
+	void write_memory(chipdef::memorydef const & md, int start, Iter first, Iter last,
+		std::vector<bool> const * skip_pages = 0, bool erased = false, bool verify = false)
 	{
 		if (md.pagesize == 0)
 		{
-			this->write_mempage(md.memid, start, first, last);
+			this->write_mempage(md, start, first, last);
 		}
 		else
 		{
 			BOOST_ASSERT(start % md.pagesize == 0);
-			while (first != last)
+
+			// All but the last page written are committed asynchronously,
+			// the last one waits for the others to finish.
+			std::size_t pages = (last - first + md.pagesize - 1) / md.pagesize;
+			std::size_t last_page = pages;
+			for (std::size_t page = 0; page < pages; ++page)
+			{
+				if (!skip_pages || page >= skip_pages->size() || !(*skip_pages)[page])
+					last_page = page;
+			}
+
+			std::deque<std::size_t> page_acks;
+			for (std::size_t page = 0; first != last; ++page)
 			{
 				int chunk = (std::min)((std::size_t)(last - first), md.pagesize);
-				this->write_mempage(md.memid, start, first, first + chunk);
+				if (!skip_pages || page >= skip_pages->size() || !(*skip_pages)[page])
+					page_acks.push_back(this->write_mempage(md, start, first, first + chunk, erased, page != last_page, verify));
 				first += chunk;
 				start += chunk;
+
+				if (page_acks.size() > m_write_window)
+				{
+					this->receive_acks(m_pending_acks.size() - page_acks.front());
+					page_acks.pop_front();
+				}
+			}
+		}
+
+		this->receive_acks();
+	}
+
+	// Loads an Intel HEX file, or the standard input if `file` is empty.
+	// Returns the flattened image, the segments are stored in `image`.
+	std::vector<uint8_t> load_program(std::string const & file, memory_image & image)
+	{
+		input_buffer input;
+		if (file.empty())
+			input.read_stdin();
+		else
+			input.open(file);
+
+		parse_ihex(input.begin(), input.end(), image);
+		return flatten_image(image);
+	}
+
+	// Marks the pages of `program` that need not be written: right after
+	// a chip erase, the pages the image leaves at 0xff are already blank.
+	// Pages covered by the image only partially are reported, their gaps
+	// get programmed as 0xff.
+	std::vector<bool> find_blank_pages(chipdef::memorydef const & md, memory_image const & image, std::vector<uint8_t> const & program)
+	{
+		std::size_t pages = (program.size() + md.pagesize - 1) / md.pagesize;
+
+		std::vector<std::size_t> covered(pages);
+		for (std::size_t i = 0; i < image.size(); ++i)
+		{
+			uint32_t addr = image[i].address;
+			while (addr != image[i].end())
+			{
+				std::size_t page = addr / md.pagesize;
+				uint32_t chunk = (std::min)(image[i].end(), (uint32_t)((page + 1) * md.pagesize)) - addr;
+				covered[page] += chunk;
+				addr += chunk;
+			}
+		}
+
+		bool erased = m_flash_erased && md.memid == 1;
+
+		std::vector<bool> res(pages);
+		std::size_t partial = 0;
+		std::size_t first_partial = 0;
+		for (std::size_t page = 0; page < pages; ++page)
+		{
+			std::size_t first = page * md.pagesize;
+			std::size_t last = (std::min)(first + md.pagesize, program.size());
+			if (covered[page] != 0 && covered[page] != last - first && partial++ == 0)
+				first_partial = first;
+
+			if (erased)
+			{
+				res[page] = true;
+				for (std::size_t i = first; res[page] && i < last; ++i)
+					res[page] = program[i] == 0xff;
 			}
 		}
+
+		if (partial != 0)
+		{
+			std::cerr << (boost::format("warning: %d page(s) only partially covered by the image, first at 0x%x;\n"
+				"    the gaps will be programmed as 0xff") % partial % first_partial) << std::endl;
+		}
+
+		return res;
 	}
 
 	chipdef::memorydef const & get_memdef(chipdef const & cd, std::string const & memname)
@@ -513,7 +885,8 @@ struct app
 	{
 		chipdef::memorydef const & md = this->get_memdef(cd, memname);
 		std::vector<uint8_t> fuses;
-		this->read_memory(md.memid, 0, md.size, appender(fuses));
+		appender_functor<std::vector<uint8_t> > app(fuses);
+		this->read_memory(md.memid, 0, md.size, app);
 		return fuses;
 	}
 
@@ -566,7 +939,7 @@ struct app
 				throw std::runtime_error("invalid response");
 			if (cmd_parser[1] != 0)
 				throw std::runtime_error("error: error occured while selecting a new mode into the programmer");
-			m_current_mode = new_mode;
+			this->read_current_mode();
 			this->print_mode(m_current_mode);
 		}
 		else if (cmd == ":chipid")
@@ -596,9 +969,30 @@ struct app
 		else if (cmd == ":read")
 		{
 			ensure_programming_mode();
+			image_output::format_t format = image_output::fmt_ihex;
+			std::string output;
+			std::vector<char *> args;
+			for (int i = 0; i < argc; ++i)
+			{
+				std::string arg = argv[i];
+				if (arg.compare(0, 9, "--window=") == 0)
+					m_read_window = (std::max)(boost::lexical_cast<uint32_t>(arg.substr(9)), 1u);
+				else if (arg.compare(0, 8, "--chunk=") == 0)
+					m_read_chunk = (std::max)((std::min)(boost::lexical_cast<uint32_t>(arg.substr(8)), 0xffffu), 1u);
+				else if (arg.compare(0, 9, "--format=") == 0)
+					format = image_output::parse_format(arg.substr(9));
+				else if (arg.compare(0, 9, "--output=") == 0)
+					output = arg.substr(9);
+				else
+					args.push_back(argv[i]);
+			}
+			argc = args.size();
+			argv = args.empty()? 0: &args[0];
+
 			if (argc < 1)
 			{
-				std::cerr << "Usage: avricsp <dev> :read <memorytype> [<start>] [<length>]" << std::endl;
+				std::cerr << "Usage: avricsp <dev> :read <memorytype> [<start>] [<length>] [--window=<n>] [--chunk=<n>]\n"
+					"    [--format=(ihex | srec | bin)] [--output=<file>]" << std::endl;
 				return 0;
 			}
 			
@@ -639,8 +1033,22 @@ struct app
 				return 6;
 			}
 
-			hex_output out(start);
-			this->read_memory(md.memid, start, length, out);
+			std::ofstream fout;
+			if (!output.empty())
+			{
+				fout.open(output.c_str(), std::ios::binary);
+				if (!fout)
+					throw std::runtime_error("failed to open the output file: " + output);
+			}
+#ifdef WIN32
+			else if (format == image_output::fmt_binary)
+			{
+				_setmode(_fileno(stdout), _O_BINARY);
+			}
+#endif
+
+			image_output out(output.empty()? std::cout: fout, format, start, start + length);
+			this->read_memory_timed(md.memid, start, length, out);
 			out.close();
 		}
 		else if (cmd == ":erase")
@@ -648,97 +1056,402 @@ struct app
 			ensure_programming_mode();
 			send_packet(0x50);
 			receive_packet(5);
+			m_flash_erased = cmd_parser.size() == 1 && cmd_parser[0] == 0;
 		}
 		else if (cmd == ":write")
 		{
+			std::string file;
+			bool diff = false;
+			bool verify = false;
+			std::vector<char *> args;
+			for (int i = 0; i < argc; ++i)
+			{
+				std::string arg = argv[i];
+				if (arg.compare(0, 7, "--file=") == 0)
+					file = arg.substr(7);
+				else if (arg == "--diff")
+					diff = true;
+				else if (arg == "--verify")
+					verify = true;
+				else
+					args.push_back(argv[i]);
+			}
+			argc = args.size();
+			argv = args.empty()? 0: &args[0];
+
+			if (argc < 1)
+			{
+				std::cerr << "Usage: avricsp <dev> :write <memorytype> [<pagesize>] [--file=<hexfile>] [--diff] [--verify]" << std::endl;
+				return 0;
+			}
+
 			ensure_programming_mode();
+
+			// A page is skipped if its 16-bit crc matches, so a changed page
+			// that happens to collide is left unwritten. Over ISP, a page
+			// rewritten without erasing the whole chip would be programmed
+			// on top of its old contents, so only PDI can write selectively.
+			if (diff && m_current_mode != 0xc2a4dd67)
+			{
+				std::cerr << "error: --diff is only supported in PDI mode" << std::endl;
+				return 4;
+			}
+
 			read_chip_def(m_cd2);
 			chipdef::memorydef md = this->get_memdef(m_cd2, argv[0]);
 
+			if (argc > 1)
+				md.pagesize = boost::lexical_cast<std::size_t>(argv[1]);
+
+			memory_image image;
+			std::vector<uint8_t> program = this->load_program(file, image);
+			if (md.size != 0 && program.size() > md.size)
+			{
+				std::cerr << "abort: the program will not fit in" << std::endl;
+				return 4;
+			}
+
+			std::vector<bool> skip_pages;
+			if (md.pagesize != 0 && !program.empty())
+			{
+				skip_pages = this->find_blank_pages(md, image, program);
+				std::size_t blank = std::count(skip_pages.begin(), skip_pages.end(), true);
+				if (blank != 0)
+					std::cerr << "erased: skipping " << std::dec << blank << " blank page(s)" << std::endl;
+
+				if (diff && !this->supports_command(15))
+				{
+					std::cerr << "warning: the programmer can't hash pages, writing all of them" << std::endl;
+				}
+				else if (diff)
+				{
+					std::vector<bool> unchanged = this->find_unchanged_pages(md, md.pagesize, 0, program.begin(), program.end());
+					std::cerr << "diff: " << std::dec << std::count(unchanged.begin(), unchanged.end(), false)
+						<< " of " << unchanged.size() << " pages changed" << std::endl;
+					for (std::size_t i = 0; i < skip_pages.size(); ++i)
+						skip_pages[i] = skip_pages[i] || unchanged[i];
+				}
+			}
+
+			// The programmer verifies each page right after writing it
+			// if it can, otherwise the memory is read back afterwards.
+			bool fused_verify = verify && md.pagesize != 0 && md.memid != 3 && this->can_verify_writes();
+			this->write_memory(md, 0, program.begin(), program.end(), skip_pages.empty()? 0: &skip_pages,
+				m_flash_erased && md.memid == 1, fused_verify);
+			if (md.memid == 1)
+				m_flash_erased = false;
+
+			if (verify && !fused_verify && !program.empty())
+			{
+				std::vector<uint8_t> contents;
+				appender_functor<std::vector<uint8_t> > app(contents);
+				this->read_memory(md.memid, 0, program.size(), app);
+				if (contents != program)
+				{
+					std::cerr << "verify: mismatch" << std::endl;
+					return 11;
+				}
+			}
+		}
+		else if (cmd == ":verify")
+		{
+			std::string file;
+			bool crc = false;
+			std::vector<char *> args;
+			for (int i = 0; i < argc; ++i)
+			{
+				std::string arg = argv[i];
+				if (arg.compare(0, 7, "--file=") == 0)
+					file = arg.substr(7);
+				else if (arg == "--crc")
+					crc = true;
+				else
+					args.push_back(argv[i]);
+			}
+			argc = args.size();
+			argv = args.empty()? 0: &args[0];
+
 			if (argc < 1)
 			{
-				std::cerr << "Usage: avricsp <dev> :write <memorytype> [<pagesize>]" << std::endl;
+				std::cerr << "Usage: avricsp <dev> :verify <memorytype> [--file=<hexfile>] [--crc]" << std::endl;
 				return 0;
 			}
 
-			if (argc > 1)
-				md.pagesize = boost::lexical_cast<std::size_t>(argv[1]);
+			ensure_programming_mode();
+			read_chip_def(m_cd2);
+			chipdef::memorydef const & md = this->get_memdef(m_cd2, argv[0]);
 
-			std::istream & fin = std::cin;
+			memory_image image;
+			std::vector<uint8_t> program = this->load_program(file, image);
+			if (md.size != 0 && program.size() > md.size)
+			{
+				std::cerr << "abort: the program will not fit in" << std::endl;
+				return 4;
+			}
 
-			std::vector<uint8_t> program;
-			std::vector<uint8_t> rec_nums;
-			std::string line;
-			int lineno = 0;
-			uint32_t base = 0;
-			while (std::getline(fin, line))
+			if (program.empty())
+				return 0;
+
+			stopwatch sw;
+			bool match;
+			if (crc && !this->supports_command(15))
+			{
+				std::cerr << "warning: the programmer can't compute checksums, reading the memory back" << std::endl;
+				crc = false;
+			}
+
+			if (crc && md.memid == 1 && m_current_mode == 0xc2a4dd67)
+			{
+				// The NVM controller sums whole words.
+				uint32_t length = (program.size() + 1) & ~1;
+				match = this->read_flash_crc(0, length) == nvm_crc24(program.begin(), program.end());
+			}
+			else if (crc && md.memid != 3)
+			{
+				uint32_t blocksize = md.pagesize? md.pagesize: (std::min)(program.size(), (std::size_t)1024);
+				std::vector<bool> unchanged = this->find_unchanged_pages(md, blocksize, 0, program.begin(), program.end());
+				match = std::count(unchanged.begin(), unchanged.end(), false) == 0;
+			}
+			else
 			{
-				++lineno;
+				std::vector<uint8_t> contents;
+				appender_functor<std::vector<uint8_t> > app(contents);
+				this->read_memory(md.memid, 0, program.size(), app);
+				match = contents == program;
+			}
 
-				if (line[0] != ':')
+			std::cerr << (boost::format("verify: %s (%.3fs)") % (match? "ok": "mismatch") % sw.elapsed()) << std::endl;
+			if (!match)
+				return 11;
+		}
+		else if (cmd == ":watch")
+		{
+			uint32_t period = 1000;
+			double duration = 10;
+			std::vector<std::pair<uint16_t, uint8_t> > watches;
+			for (int i = 0; i < argc; ++i)
+			{
+				std::string arg = argv[i];
+				if (arg.compare(0, 9, "--period=") == 0)
+					period = (std::max)((std::min)(boost::lexical_cast<uint32_t>(arg.substr(9)), 0xffffu), 1u);
+				else if (arg.compare(0, 7, "--time=") == 0)
+					duration = boost::lexical_cast<double>(arg.substr(7));
+				else
 				{
-					std::cerr << "error: input file corrupt" << std::endl;
-					return 3;
+					std::size_t colon = arg.find(':');
+					uint16_t addr = (uint16_t)strtoul(arg.substr(0, colon).c_str(), 0, 0);
+					uint8_t size = colon == std::string::npos? 1: (uint8_t)strtoul(arg.substr(colon + 1).c_str(), 0, 0);
+					watches.push_back(std::make_pair(addr, size));
 				}
-				
-				if (!line.empty() && line.end()[-1] == '\r')
-					line.erase(line.end() - 1);
-	
-				if (line.empty())
-					continue;
-	
-				if (line[0] != ':' || line.size() % 2 != 1)
-					throw hex_parse_error("An error occured", lineno);
-	
-				rec_nums.clear();
-				for (std::size_t offs = 1; offs < line.size(); offs += 2)
+			}
+
+			if (watches.empty())
+			{
+				std::cerr << "Usage: avricsp <dev> :watch <address>[:<size>]... [--period=<us>] [--time=<seconds>]" << std::endl;
+				return 0;
+			}
+
+			ensure_programming_mode();
+			if (m_current_mode != 0xc2a4dd67 || !this->supports_command(15))
+				throw std::runtime_error("the programmer can't watch the target's memory in this mode");
+
+			uint8_t const clear_req[] = { 2 };
+			this->send_frame(15, clear_req, clear_req + sizeof clear_req);
+			this->receive_ext_packet(2);
+
+			std::size_t sample_size = 0;
+			for (std::size_t i = 0; i < watches.size(); ++i)
+			{
+				uint8_t const add_req[] = { 3, (uint8_t)watches[i].first, (uint8_t)(watches[i].first >> 8), watches[i].second };
+				this->send_frame(15, add_req, add_req + sizeof add_req);
+				if (this->receive_ext_packet(3) != 0)
+					throw std::runtime_error("the watch list is too long");
+				sample_size += watches[i].second;
+			}
+
+			uint8_t const start_req[] = { 4, (uint8_t)period, (uint8_t)(period >> 8) };
+			this->send_frame(15, start_req, start_req + sizeof start_req);
+			if (this->receive_ext_packet(4) != 0 || cmd_parser.size() != 4)
+				throw std::runtime_error("failed to start watching the target");
+			double ticks_per_ms = cmd_parser[2] | (cmd_parser[3] << 8);
+
+			// The samples are 2'dropped (2'timestamp data)*, the 16-bit
+			// timestamps and dropped-sample counters wrap around.
+			stopwatch sw;
+			uint64_t samples = 0;
+			uint64_t dropped = 0;
+			uint16_t last_dropped = 0;
+			uint64_t ticks = 0;
+			uint16_t last_timestamp = 0;
+			bool stopping = false;
+			for (;;)
+			{
+				if (!stopping && sw.elapsed() >= duration)
 				{
-					std::string digit(&line[offs], 2);
-					uint8_t res = uint8_t(strtol(digit.c_str(), 0, 16));
-					rec_nums.push_back(res);
+					this->send_frame(15, clear_req, clear_req + sizeof clear_req);
+					stopping = true;
 				}
-	
-				int length = rec_nums[0];
-				int address = rec_nums[1] * 0x100 + rec_nums[2];
-				int rectype = rec_nums[3];
-	
-				if (length != rec_nums.size() - 5)
-					throw hex_parse_error("Invalid record length specified", lineno);
-	
-				if (rectype == 2)
+
+				// Packets on other commands are the board's own.
+				if (this->receive_any_packet() != 15 || cmd_parser.size() < 2)
+					continue;
+
+				if (cmd_parser[0] == 2 && stopping)
+					break;
+
+				if (cmd_parser[0] != 6)
+					throw std::runtime_error("received invalid response");
+
+				if (cmd_parser[1] != 0)
 				{
-					if (length != 2)
-						throw hex_parse_error("Invalid type 2 record", lineno);
-					base = (rec_nums[4] * 0x100 + rec_nums[5]) * 16;
+					if (!stopping)
+						throw std::runtime_error("the programmer failed to read the target's memory");
 					continue;
 				}
-	
-				if (rectype == 1)
-					break;
-	
-				if (rectype != 0)
-					throw hex_parse_error("Invalid record type", lineno);
-	
-				for (int i = 0; i < length; ++i)
+
+				if (cmd_parser.size() < 4 || (cmd_parser.size() - 4) % (sample_size + 2) != 0)
+					throw std::runtime_error("received invalid response");
+
+				uint16_t d = cmd_parser[2] | (cmd_parser[3] << 8);
+				dropped += (uint16_t)(d - last_dropped);
+				last_dropped = d;
+
+				for (std::size_t pos = 4; pos != cmd_parser.size(); )
 				{
-					if (base + address + i >= int(program.size()))
-						program.resize(base + address + i + 1, 0xff);
-	
-					uint8_t & c = program[base + address + i];
-					if (c != 0xff)
-						throw hex_parse_error("A memory location was defined twice", lineno);
-	
-					c = rec_nums[i + 4];
+					uint16_t timestamp = cmd_parser[pos] | (cmd_parser[pos+1] << 8);
+					ticks += samples? (uint16_t)(timestamp - last_timestamp): 0;
+					last_timestamp = timestamp;
+					pos += 2;
+
+					std::cout << boost::format("%.3f") % (ticks / ticks_per_ms);
+					for (std::size_t i = 0; i < watches.size(); ++i)
+					{
+						std::cout << ' ';
+						if (watches[i].second <= 4)
+						{
+							uint32_t value = 0;
+							for (uint8_t j = 0; j < watches[i].second; ++j)
+								value |= (uint32_t)cmd_parser[pos + j] << (8 * j);
+							std::cout << value;
+						}
+						else
+						{
+							for (uint8_t j = 0; j < watches[i].second; ++j)
+								std::cout << boost::format("%02x") % (int)cmd_parser[pos + j];
+						}
+						pos += watches[i].second;
+					}
+					std::cout << '\n';
+					++samples;
 				}
 			}
-			
-			if (md.size != 0 && program.size() > md.size)
+
+			double elapsed = ticks / ticks_per_ms / 1000;
+			std::cout.flush();
+			std::cerr << (boost::format("watch: %d samples in %.2fs (%.0f samples/s), %d dropped")
+				% samples % elapsed % (elapsed > 0? samples / elapsed: 0) % dropped) << std::endl;
+		}
+		else if (cmd == ":pdi")
+		{
+			// Assembles the script executed by the programmer, see
+			// handler_xmega::run_script for the encoding.
+			std::vector<uint8_t> script(1, 5);
+			std::size_t read_count = 0;
+			for (int i = 0; i < argc; )
 			{
-				std::cerr << "abort: the program will not fit in" << std::endl;
-				return 4;
+				std::string op = argv[i++];
+				std::vector<uint32_t> operands;
+				int operand_count = op == "lds" || op == "sts" || op == "stcs"? 2
+					: op == "ldcs" || op == "ptr" || op == "ld" || op == "st"? 1
+					: op == "nvmwait"? 0: -1;
+				if (operand_count < 0 || i + operand_count > argc)
+				{
+					std::cerr << "Usage: avricsp <dev> :pdi <instruction>...\n"
+						"    lds <addr> <count> | sts <addr> <byte> | ldcs <reg> | stcs <reg> <byte>\n"
+						"    | ptr <addr> | ld <count> | st <hexbytes> | nvmwait" << std::endl;
+					return 4;
+				}
+
+				if (op == "st")
+				{
+					std::string hex = argv[i++];
+					if (hex.empty() || hex.size() % 2 != 0 || hex.size() > 510)
+						throw std::runtime_error("st takes 1 to 255 bytes in hex");
+					script.push_back(6);
+					script.push_back(hex.size() / 2);
+					for (std::size_t j = 0; j < hex.size(); j += 2)
+						script.push_back((uint8_t)strtoul(hex.substr(j, 2).c_str(), 0, 16));
+					continue;
+				}
+
+				for (int j = 0; j < operand_count; ++j)
+					operands.push_back(strtoul(argv[i++], 0, 0));
+
+				if (op == "lds")
+				{
+					if (operands[1] < 1 || operands[1] > 4)
+						throw std::runtime_error("lds reads 1 to 4 bytes");
+					script.push_back(0);
+					for (int j = 0; j < 4; ++j)
+						script.push_back(operands[0] >> (8 * j));
+					script.push_back(operands[1]);
+					read_count += operands[1];
+				}
+				else if (op == "sts")
+				{
+					script.push_back(1);
+					for (int j = 0; j < 4; ++j)
+						script.push_back(operands[0] >> (8 * j));
+					script.push_back(operands[1]);
+				}
+				else if (op == "ldcs")
+				{
+					script.push_back(2);
+					script.push_back(operands[0]);
+					++read_count;
+				}
+				else if (op == "stcs")
+				{
+					script.push_back(3);
+					script.push_back(operands[0]);
+					script.push_back(operands[1]);
+				}
+				else if (op == "ptr")
+				{
+					script.push_back(4);
+					for (int j = 0; j < 4; ++j)
+						script.push_back(operands[0] >> (8 * j));
+				}
+				else if (op == "ld")
+				{
+					if (operands[0] < 1 || operands[0] > 255)
+						throw std::runtime_error("ld reads 1 to 255 bytes");
+					script.push_back(5);
+					script.push_back(operands[0]);
+					read_count += operands[0];
+				}
+				else
+				{
+					script.push_back(7);
+				}
 			}
 
-			this->write_memory(md, 0, program.begin(), program.end());
+			if (script.size() > m_max_out_payload || read_count + 2 > m_max_in_payload)
+				throw std::runtime_error("the script is too long for the programmer");
+
+			ensure_programming_mode();
+			if (m_current_mode != 0xc2a4dd67 || !this->supports_command(15))
+				throw std::runtime_error("the programmer can't run PDI scripts in this mode");
+
+			this->send_frame(15, &script[0], &script[0] + script.size());
+			if (this->receive_ext_packet(5) != 0)
+				throw std::runtime_error("the script failed");
+			if (cmd_parser.size() != read_count + 2)
+				throw std::runtime_error("received invalid response");
+
+			for (std::size_t i = 2; i < cmd_parser.size(); ++i)
+				std::cout << boost::format("%02x") % (int)cmd_parser[i];
+			std::cout << std::endl;
 		}
 		else if (cmd == ":writefuses")
 		{
@@ -844,26 +1557,102 @@ struct app
 		return 0;
 	}
 
+	struct signature_is
+	{
+		explicit signature_is(std::string const & signature)
+			: signature(signature)
+		{
+		}
+
+		bool operator()(std::pair<std::string, uint16_t> const & clock) const
+		{
+			return clock.first == signature;
+		}
+
+		std::string signature;
+	};
+
+	// The PDI clocks found so far are kept one per line as
+	// `<signature> <bsel>`, the most recently used chip last.
+	static std::string pdi_clocks_path()
+	{
+#ifdef WIN32
+		char const * dir = getenv("APPDATA");
+		return dir? std::string(dir) + "\\avricsp_clocks": std::string();
+#else
+		char const * dir = getenv("HOME");
+		return dir? std::string(dir) + "/.avricsp_clocks": std::string();
+#endif
+	}
+
+	static std::vector<std::pair<std::string, uint16_t> > load_pdi_clocks()
+	{
+		std::vector<std::pair<std::string, uint16_t> > res;
+		std::string path = pdi_clocks_path();
+		if (path.empty())
+			return res;
+
+		std::ifstream fin(path.c_str());
+		std::string signature;
+		unsigned bsel;
+		while (fin >> signature >> bsel)
+		{
+			if (bsel != 0 && bsel < 0xffff)
+				res.push_back(std::make_pair(signature, (uint16_t)bsel));
+		}
+		return res;
+	}
+
+	// The cache is only an optimization, failing to write it is not an error.
+	static void save_pdi_clocks(std::vector<std::pair<std::string, uint16_t> > const & clocks)
+	{
+		std::string path = pdi_clocks_path();
+		if (path.empty())
+			return;
+
+		std::ofstream fout(path.c_str());
+		for (std::size_t i = 0; i < clocks.size(); ++i)
+			fout << clocks[i].first << ' ' << clocks[i].second << '\n';
+	}
+
 	void read_chip_def(chipdef & cd)
+	{
+		if (!this->try_read_chip_def(cd))
+			throw std::runtime_error("failed to read chip signature");
+	}
+
+	bool try_read_chip_def(chipdef & cd)
 	{
 		if (!cd.signature.empty())
-			return;
+			return true;
 
 		send_packet(0x30);
 		receive_packet(3);
-		if (cmd_parser.size() < 3)
-			throw std::runtime_error("failed to read chip signature");
+		// The signature bytes are followed by an error code.
+		if (cmd_parser.size() < 4 || cmd_parser[cmd_parser.size() - 1] != 0)
+			return false;
 		cd.signature = m_current_mode == 0x871e0846? "avr:": "avrx:";
-		for (size_t i = 0; i < cmd_parser.size(); ++i)
+		for (size_t i = 0; i + 1 < cmd_parser.size(); ++i)
 		{
 			static char const hexdigits[] = "0123456789abcdef";
 			cd.signature.push_back(hexdigits[(cmd_parser[i] >> 4) & 0xf]);
 			cd.signature.push_back(hexdigits[cmd_parser[i] & 0xf]);
 		}
 		update_chipdef(chipdefs, cd);
+		return true;
 	}
 	
 private:
+	static const int receive_timeout_ms = 5000;
+
+	// The SPI clock for ISP parts that can't be polled,
+	// about 62 kHz, slow enough for the oldest of them.
+	static const uint16_t isp_nopoll_bsel = 256;
+
+	// The PDI clock the signature is read at before a cached clock
+	// is tried, the one the programmer starts its search at.
+	static const uint16_t pdi_safe_bsel = 64;
+
 	std::vector<uint8_t> m_id;
 
 	std::map<uint32_t, uint32_t> m_modes;
@@ -877,6 +1666,26 @@ private:
 	chipdef m_cd2;
 
 	bool m_programming_mode;
+
+	// Set by :erase, cleared once the flash is written to.
+	bool m_flash_erased;
+
+	uint32_t m_read_window;
+	uint32_t m_read_chunk;
+	uint32_t m_max_in_payload;
+
+	// The commands awaiting acknowledgement and the addresses
+	// of the pages they belong to.
+	std::deque<std::pair<uint8_t, uint32_t> > m_pending_acks;
+
+	// Kept to a simple frame and a single command unless the programmer's
+	// capabilities say it accepts long payloads.
+	std::size_t m_write_window;
+	std::size_t m_max_out_payload;
+
+	// Set from the programmer's capabilities, zero if it doesn't report them.
+	uint8_t m_device_flags;
+	uint16_t m_device_commands;
 };
 
 int main(int argc, char * argv[])
@@ -0,0 +1,79 @@
+#ifndef SHUPITO_SIM_HOST_AVR_IO_H
+#define SHUPITO_SIM_HOST_AVR_IO_H
+
+// The avr-libc names of the registers sim_mcu models,
+// and of the bits fw_common's pdi_t uses.
+
+#include "../../sim_mcu.hpp"
+
+#define SREG sim_sreg
+
+inline void cli()
+{
+	sim_sreg &= ~0x80;
+}
+
+inline void sei()
+{
+	sim_sreg |= 0x80;
+	g_mcu.poll();
+}
+
+#define ISR(vector) \
+	static void vector##_isr(); \
+	static struct vector##_install { vector##_install() { sim_vectors[vector] = &vector##_isr; } } vector##_installed; \
+	static void vector##_isr()
+
+#define USARTC0_DATA USARTC0.DATA
+#define USARTC0_STATUS USARTC0.STATUS
+#define USARTC0_CTRLA USARTC0.CTRLA
+#define USARTC0_CTRLB USARTC0.CTRLB
+#define USARTC0_CTRLC USARTC0.CTRLC
+#define USARTC0_BAUDCTRLA USARTC0.BAUDCTRLA
+#define USARTC0_BAUDCTRLB USARTC0.BAUDCTRLB
+
+#define USART_RXCIF_bm 0x80
+#define USART_TXCIF_bm 0x40
+#define USART_DREIF_bm 0x20
+#define USART_FERR_bm 0x10
+#define USART_BUFOVF_bm 0x08
+#define USART_PERR_bm 0x04
+
+#define USART_RXCINTLVL_MED_gc 0x20
+#define USART_TXCINTLVL_HI_gc 0x0C
+#define USART_DREINTLVL_MED_gc 0x02
+
+#define USART_RXEN_bm 0x10
+#define USART_TXEN_bm 0x08
+
+#define USART_CMODE_SYNCHRONOUS_gc 0x40
+#define USART_PMODE_EVEN_gc 0x20
+#define USART_SBMODE_bm 0x08
+#define USART_CHSIZE_8BIT_gc 0x03
+
+#define DMA_CTRL DMA.CTRL
+#define DMA_ENABLE_bm 0x80
+
+#define DMA_CH_ENABLE_bm 0x80
+#define DMA_CH_SINGLE_bm 0x04
+#define DMA_CH_BURSTLEN_1BYTE_gc 0x00
+#define DMA_CH_TRNIF_bm 0x10
+#define DMA_CH_ERRIF_bm 0x20
+#define DMA_CH_SRCRELOAD_NONE_gc 0x00
+#define DMA_CH_SRCDIR_gm 0x30
+#define DMA_CH_SRCDIR_INC_gc 0x10
+#define DMA_CH_DESTRELOAD_NONE_gc 0x00
+#define DMA_CH_DESTDIR_FIXED_gc 0x00
+#define DMA_CH_TRIGSRC_USARTC0_DRE_gc 0x4C
+
+#define TCE0_CTRLA TCE0.CTRLA
+#define TCE0_INTCTRLB TCE0.INTCTRLB
+#define TCE0_INTFLAGS TCE0.INTFLAGS
+#define TCE0_CNT TCE0.CNT
+#define TCE0_CCA TCE0.CCA
+
+#define TC_CLKSEL_DIV256_gc 0x06
+#define TC0_CCAIF_bm 0x10
+#define TC_CCAINTLVL_MED_gc 0x02
+
+#endif
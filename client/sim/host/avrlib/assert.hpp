@@ -0,0 +1,8 @@
+#ifndef SHUPITO_SIM_HOST_AVRLIB_ASSERT_HPP
+#define SHUPITO_SIM_HOST_AVRLIB_ASSERT_HPP
+
+#include <assert.h>
+
+#define AVRLIB_ASSERT(x) assert(x)
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SHUPITO_SIM_HOST_AVRLIB_BUFFER_HPP
+#define SHUPITO_SIM_HOST_AVRLIB_BUFFER_HPP
+
+#include <stdint.h>
+
+namespace avrlib {
+
+// A fixed-capacity FIFO, as avrlib's.
+template <typename T, uint8_t Capacity>
+class buffer
+{
+public:
+	buffer()
+		: m_first(0), m_size(0)
+	{
+	}
+
+	bool empty() const { return m_size == 0; }
+	bool full() const { return m_size == Capacity; }
+	uint8_t size() const { return m_size; }
+
+	void clear()
+	{
+		m_first = 0;
+		m_size = 0;
+	}
+
+	void push(T const & value)
+	{
+		m_data[(m_first + m_size) % Capacity] = value;
+		++m_size;
+	}
+
+	T const & top() const
+	{
+		return m_data[m_first];
+	}
+
+	void pop()
+	{
+		m_first = (m_first + 1) % Capacity;
+		--m_size;
+	}
+
+private:
+	T m_data[Capacity];
+	uint8_t m_first;
+	uint8_t m_size;
+};
+
+}
+
+#endif
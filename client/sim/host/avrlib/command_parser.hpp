@@ -0,0 +1,9 @@
+#ifndef SHUPITO_SIM_HOST_AVRLIB_COMMAND_PARSER_HPP
+#define SHUPITO_SIM_HOST_AVRLIB_COMMAND_PARSER_HPP
+
+// The simulator parses the framing with the client's command_parser,
+// the handlers only need the fixed-width integer types.
+
+#include <stdint.h>
+
+#endif
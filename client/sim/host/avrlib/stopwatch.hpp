@@ -0,0 +1,16 @@
+#ifndef SHUPITO_SIM_HOST_AVRLIB_STOPWATCH_HPP
+#define SHUPITO_SIM_HOST_AVRLIB_STOPWATCH_HPP
+
+namespace avrlib {
+
+template <typename Clock, typename Process>
+void wait(Clock & clock, typename Clock::time_type time, Process process)
+{
+	typename Clock::time_type start = clock.value();
+	while ((typename Clock::time_type)(clock.value() - start) < time)
+		process();
+}
+
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef SHUPITO_SIM_HOST_UTIL_CRC16_H
+#define SHUPITO_SIM_HOST_UTIL_CRC16_H
+
+#include "../../../crc.hpp"
+
+inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	return crc_ccitt_update(crc, data);
+}
+
+#endif
@@ -0,0 +1,532 @@
+// A virtual Shupito programmer.
+//
+// The simulator opens a pseudo-terminal and speaks the same framing and
+// handshake as the programmer, so the unmodified client can be pointed
+// at the pty's slave device. Behind the framing, fw_common's
+// handler_xmega and handler_avricsp run unmodified on host stand-ins
+// of their PDI, SPI and timer drivers (sim_hw.hpp), which talk to
+// a simulated XMEGA or classic AVR with its flash, EEPROM and fuses.
+// Page-write latency and link bandwidth are configurable, which makes
+// it possible to measure throughput changes on a machine without any
+// hardware attached.
+
+#include "sim.hpp"
+#include "sim_hw.hpp"
+#include "../command_parser.hpp"
+#include "../../fw_common/handler_xmega.hpp"
+#include "../../fw_common/handler_avricsp.hpp"
+#include "../../fw_common/pdi.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+sim_isp_target * sim_reset_pin::target = 0;
+
+typedef pdi_t<sim_clock, sim_pdi_clk, sim_pdi_data, sim_pdi_led, 0> sim_pdi_t;
+
+static sim_clock g_clock;
+static sim_pdi_t pdi(g_clock);
+
+ISR(USARTC0_DRE_vect) { pdi.intr_udre(); }
+ISR(USARTC0_TXC_vect) { pdi.intr_txc(); }
+ISR(USARTC0_RXC_vect) { pdi.intr_rxc(); }
+ISR(TCE0_CCA_vect) { pdi.intr_alarm(); }
+
+// The master side of the pseudo-terminal, throttled to the configured
+// link bandwidth in both directions.
+class sim_link
+{
+public:
+	explicit sim_link(uint32_t bandwidth)
+		: m_master(-1), m_slave(-1), m_bandwidth(bandwidth), m_rx_time(0), m_tx_time(0)
+	{
+	}
+
+	~sim_link()
+	{
+		if (m_slave != -1)
+			::close(m_slave);
+		if (m_master != -1)
+			::close(m_master);
+	}
+
+	std::string open()
+	{
+		m_master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (m_master < 0 || grantpt(m_master) != 0 || unlockpt(m_master) != 0)
+			throw std::runtime_error("failed to create a pseudo-terminal");
+
+		std::string name = ptsname(m_master);
+
+		// Keep the slave open, so that the pty survives the client
+		// closing and reopening it between sessions.
+		m_slave = ::open(name.c_str(), O_RDWR | O_NOCTTY);
+		if (m_slave < 0)
+			throw std::runtime_error("failed to open the pseudo-terminal's slave");
+
+		termios config;
+		tcgetattr(m_slave, &config);
+		cfmakeraw(&config);
+		tcsetattr(m_slave, TCSANOW, &config);
+
+		return name;
+	}
+
+	std::size_t read(uint8_t * buf, std::size_t size)
+	{
+		for (;;)
+		{
+			ssize_t r = ::read(m_master, buf, size);
+			if (r > 0)
+			{
+				m_rx_time = (std::max)(m_rx_time, now_us()) + this->transfer_time(r);
+				return r;
+			}
+
+			if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EIO)
+				throw std::runtime_error("failed to read from the pseudo-terminal");
+			if (r < 0 && errno == EIO)
+				sleep_for(10000);
+		}
+	}
+
+	// Returns false if nothing arrives before `deadline`.
+	bool wait_readable(uint64_t deadline)
+	{
+		for (;;)
+		{
+			uint64_t n = now_us();
+			if (n >= deadline)
+				return false;
+
+			pollfd pfd = { m_master, POLLIN, 0 };
+			int r = ::poll(&pfd, 1, (int)((deadline - n) / 1000));
+			if (r > 0)
+				return true;
+			if (r < 0 && errno != EINTR)
+				throw std::runtime_error("failed to wait for the pseudo-terminal");
+		}
+	}
+
+	// Waits until the bytes received so far would have arrived
+	// over the simulated link.
+	void wait_rx()
+	{
+		g_mcu.sleep_until(m_rx_time);
+	}
+
+	void write(uint8_t const * data, std::size_t size)
+	{
+		m_tx_time = (std::max)(m_tx_time, now_us()) + this->transfer_time(size);
+		g_mcu.sleep_until(m_tx_time);
+
+		while (size)
+		{
+			ssize_t r = ::write(m_master, data, size);
+			if (r < 0)
+			{
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				throw std::runtime_error("failed to write into the pseudo-terminal");
+			}
+
+			data += r;
+			size -= r;
+		}
+	}
+
+private:
+	uint64_t transfer_time(std::size_t size) const
+	{
+		return m_bandwidth? (uint64_t)size * 1000000 / m_bandwidth: 0;
+	}
+
+	int m_master;
+	int m_slave;
+	uint32_t m_bandwidth;
+	uint64_t m_rx_time;
+	uint64_t m_tx_time;
+};
+
+// The programmer's end of the yb framing: packets longer than 15 bytes
+// and those of command 15 are sent in the chunked framing. The link never pushes back,
+// so there is always room for the next packet.
+class sim_writer
+	: public yb_writer
+{
+public:
+	sim_writer(sim_link & link, uint8_t max_packet_size)
+		: yb_writer(max_packet_size), m_link(link), m_cmd(0), m_size(0)
+	{
+	}
+
+	uint8_t avail() const
+	{
+		return 255;
+	}
+
+	uint8_t * alloc(uint8_t cmd, uint8_t size)
+	{
+		m_cmd = cmd;
+		m_size = size;
+		return m_buf;
+	}
+
+	uint8_t * alloc_sync(uint8_t cmd, uint8_t size)
+	{
+		return this->alloc(cmd, size);
+	}
+
+	void commit()
+	{
+		this->send(m_cmd, m_buf, m_size);
+	}
+
+	bool send(uint8_t cmd, uint8_t const * data, uint8_t size)
+	{
+		std::vector<uint8_t> frame;
+		frame.push_back(0x80);
+		if (size <= 15 && cmd != 15)
+		{
+			frame.push_back((cmd << 4) | size);
+			frame.insert(frame.end(), data, data + size);
+		}
+		else
+		{
+			frame.push_back(0xf0 | cmd);
+			if (size)
+			{
+				frame.push_back(size);
+				frame.insert(frame.end(), data, data + size);
+			}
+			frame.push_back(0);
+		}
+
+		m_link.write(&frame[0], frame.size());
+		return true;
+	}
+
+	void send_sync(uint8_t cmd, uint8_t const * data, uint8_t size)
+	{
+		this->send(cmd, data, size);
+	}
+
+private:
+	sim_link & m_link;
+	uint8_t m_cmd;
+	uint8_t m_size;
+	uint8_t m_buf[255];
+};
+
+class sim_device
+{
+public:
+	sim_device(sim_target & target, sim_options const & opts)
+		: m_opts(opts), m_link(opts.bandwidth), m_writer(m_link, opts.max_packet_size),
+		m_pdi_target(target, opts), m_isp_target(target, opts), m_spi(m_isp_target),
+		m_xmega(pdi, g_clock), m_avricsp(m_spi, g_clock), m_handler(0)
+	{
+		g_mcu.attach_pdi(m_pdi_target);
+		DMA_CTRL = DMA_ENABLE_bm;
+		sim_clock::init();
+
+		std::fill(m_packet, m_packet + sizeof m_packet, 0);
+		std::fill(m_worst_us, m_worst_us + 16, 0);
+		std::fill(m_worst_alarm_us, m_worst_alarm_us + 16, 0);
+		sim_reset_pin::target = &m_isp_target;
+		this->select_handler(target.pdi? (handler_base *)&m_xmega: (handler_base *)&m_avricsp);
+	}
+
+	std::string open()
+	{
+		return m_link.open();
+	}
+
+	void run()
+	{
+		std::vector<uint8_t> buf(4096);
+		for (;;)
+		{
+			// The firmware's main loop gives the handler its turn
+			// between the packets. While it waits, the peripherals
+			// get theirs when their next event comes due.
+			g_mcu.poll();
+			pdi.process();
+			if (m_handler)
+				m_handler->process_selected(m_writer);
+
+			uint64_t deadline = now_us() + 1000;
+			uint64_t next = g_mcu.next_event() / 1000;
+			if (!m_link.wait_readable(next && next < deadline? next: deadline))
+				continue;
+
+			std::size_t size = m_link.read(&buf[0], buf.size());
+			uint8_t const * first = &buf[0];
+			uint8_t const * last = first + size;
+			while (first != last)
+			{
+				uint8_t cmd;
+				first = m_parser.push_data(first, last, cmd);
+				if (cmd == 255)
+					continue;
+
+				if (cmd == 254)
+				{
+					m_parser.clear();
+					continue;
+				}
+
+				m_link.wait_rx();
+				this->dispatch(cmd);
+			}
+		}
+	}
+
+private:
+	static uint32_t const mode_avr_spi = 0x871e0846;
+	static uint32_t const mode_avrx_pdi = 0xc2a4dd67;
+
+	void dispatch(uint8_t cmd)
+	{
+		// The handlers read their arguments from the programmer's packet
+		// buffer. Past the end of a short packet, it keeps the bytes
+		// the earlier packets left there.
+		uint8_t size = (uint8_t)m_parser.size();
+		if (size)
+			std::copy(m_parser.data(), m_parser.data() + size, m_packet);
+		uint8_t const * cp = m_packet;
+
+		if (m_opts.verbose)
+		{
+			std::cerr << "cmd " << (int)cmd << ", " << (int)size << " bytes";
+			if (size)
+				std::cerr << ", memid " << (int)cp[0];
+			std::cerr << std::endl;
+		}
+
+		if (cmd == 0)
+			this->handle_device_command(cp, size);
+		else if (m_handler)
+		{
+			// The firmware's main loop is blocked for as long as a handler
+			// runs, including its waits for the link and the NVM. pdi_t's
+			// timed states must not be, their compare interrupts should
+			// only be as late as the host's scheduling makes them.
+			g_mcu.take_worst_alarm_delay();
+			uint64_t start = now_us();
+			m_handler->handle_command(cmd, cp, size, m_writer);
+			uint64_t elapsed = now_us() - start;
+			uint64_t alarm_late = g_mcu.take_worst_alarm_delay() / 1000;
+
+			if (m_opts.latency && (elapsed > m_worst_us[cmd & 0xf] || alarm_late > m_worst_alarm_us[cmd & 0xf]))
+			{
+				m_worst_us[cmd & 0xf] = (std::max)(m_worst_us[cmd & 0xf], elapsed);
+				m_worst_alarm_us[cmd & 0xf] = (std::max)(m_worst_alarm_us[cmd & 0xf], alarm_late);
+				std::cerr << "latency: cmd " << (int)cmd << " blocked for " << elapsed
+					<< " us, pdi alarms late by up to " << alarm_late << " us" << std::endl;
+			}
+		}
+	}
+
+	void handle_device_command(uint8_t const * cp, uint8_t size)
+	{
+		if (size == 0)
+		{
+			// Identify
+			static uint8_t const id[] = { 0x40, 0xbd, 0xe9, 0x9f, 0xea };
+			m_writer.send(0, id, sizeof id);
+		}
+		else if (cp[0] == 0x02)
+		{
+			// List of modes
+			std::vector<uint8_t> resp(1, 0x42);
+			append_mode(resp, mode_avr_spi);
+			append_mode(resp, mode_avrx_pdi);
+			m_writer.send(0, &resp[0], resp.size());
+		}
+		else if (cp[0] == 0x03 && size == 2)
+		{
+			// Select mode, modes are numbered from 1
+			uint8_t resp[2] = { 0x43, 0 };
+			if (cp[1] == 1)
+				resp[1] = this->select_handler(&m_avricsp);
+			else if (cp[1] == 2)
+				resp[1] = this->select_handler(&m_xmega);
+			else
+				resp[1] = 1;
+			m_writer.send(0, resp, sizeof resp);
+		}
+		else if (cp[0] == 0x04)
+		{
+			// Current mode
+			std::vector<uint8_t> resp(1, 0x44);
+			append_mode(resp, m_handler == &m_avricsp? mode_avr_spi: m_handler == &m_xmega? mode_avrx_pdi: 0);
+			m_writer.send(0, &resp[0], resp.size());
+		}
+		else if (cp[0] == 0x05 && m_opts.max_out_payload != 0)
+		{
+			// Capabilities: 1'max_in 1'max_out 1'flags 2'commands
+			uint16_t commands = m_handler? m_handler->supported_commands(): 0;
+			uint8_t resp[6] = {
+				0x45, m_opts.max_packet_size, m_opts.max_out_payload,
+				(uint8_t)((m_opts.max_out_payload > 15? 0x01: 0x00) | 0x3E),
+				(uint8_t)commands, (uint8_t)(commands >> 8)
+			};
+			m_writer.send(0, resp, sizeof resp);
+		}
+	}
+
+	uint8_t select_handler(handler_base * new_handler)
+	{
+		uint8_t err = 0;
+		if (new_handler != m_handler)
+		{
+			if (m_handler)
+				m_handler->unselect();
+			err = new_handler->select();
+			m_handler = err == 0? new_handler: 0;
+		}
+		return err;
+	}
+
+	static void append_mode(std::vector<uint8_t> & buf, uint32_t mode)
+	{
+		for (int i = 0; i < 4; ++i)
+			buf.push_back(mode >> (8 * i));
+	}
+
+	sim_options const & m_opts;
+	sim_link m_link;
+	sim_writer m_writer;
+	command_parser m_parser;
+	uint8_t m_packet[256];
+
+	sim_pdi_target m_pdi_target;
+	sim_isp_target m_isp_target;
+	sim_spi m_spi;
+
+	handler_xmega<sim_pdi_t, sim_clock, sim_process> m_xmega;
+	handler_avricsp<sim_spi, sim_clock, sim_reset_pin, sim_process> m_avricsp;
+	handler_base * m_handler;
+
+	uint64_t m_worst_us[16];
+	uint64_t m_worst_alarm_us[16];
+};
+
+static void usage()
+{
+	std::cerr << "Usage: shupito_sim [--chip <name>] [--link <path>] [--max-packet <bytes>]\n"
+		"    [--max-out <bytes>] [--bandwidth <bytes/s>] [--page-write-us <us>] [--chip-erase-us <us>]\n"
+		"    [--pdi-max-khz <kHz>] [--isp-max-khz <kHz>] [--isp-page-write-us <us>] [--isp-eeprom-write-us <us>]\n"
+		"    [--isp-fuse-write-us <us>] [--isp-chip-erase-us <us>] [--verbose] [--latency]" << std::endl;
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		sim_options opts;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (arg == "--verbose")
+			{
+				opts.verbose = true;
+				continue;
+			}
+
+			if (arg == "--latency")
+			{
+				opts.latency = true;
+				continue;
+			}
+
+			if (i + 1 == argc)
+			{
+				usage();
+				return 2;
+			}
+
+			std::string value = argv[++i];
+			if (arg == "--chip")
+				opts.chip = value;
+			else if (arg == "--link")
+				opts.link = value;
+			else if (arg == "--max-packet")
+				opts.max_packet_size = (uint8_t)boost::lexical_cast<int>(value);
+			else if (arg == "--max-out")
+				opts.max_out_payload = (uint8_t)boost::lexical_cast<int>(value);
+			else if (arg == "--bandwidth")
+				opts.bandwidth = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--page-write-us")
+				opts.page_write_us = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--chip-erase-us")
+				opts.chip_erase_us = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--pdi-max-khz")
+				opts.pdi_max_khz = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--isp-max-khz")
+				opts.isp_max_khz = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--isp-page-write-us")
+				opts.isp_page_write_us = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--isp-eeprom-write-us")
+				opts.isp_eeprom_write_us = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--isp-fuse-write-us")
+				opts.isp_fuse_write_us = boost::lexical_cast<uint32_t>(value);
+			else if (arg == "--isp-chip-erase-us")
+				opts.isp_chip_erase_us = boost::lexical_cast<uint32_t>(value);
+			else
+			{
+				usage();
+				return 2;
+			}
+		}
+
+		if (opts.max_packet_size == 0)
+			throw std::runtime_error("the maximum packet size must be non-zero");
+
+		std::vector<chipdef> chipdefs;
+		parse_chipdefs(embedded_chipdefs, chipdefs);
+
+		chipdef const * cd = 0;
+		for (std::size_t i = 0; !cd && i < chipdefs.size(); ++i)
+		{
+			if (chipdefs[i].name == opts.chip)
+				cd = &chipdefs[i];
+		}
+
+		if (!cd)
+			throw std::runtime_error("unknown chip: " + opts.chip);
+
+		sim_target target(*cd);
+		sim_device dev(target, opts);
+
+		std::string name = dev.open();
+		if (!opts.link.empty())
+		{
+			::unlink(opts.link.c_str());
+			if (::symlink(name.c_str(), opts.link.c_str()) != 0)
+				throw std::runtime_error("failed to create the link: " + opts.link);
+		}
+
+		std::cout << name << std::endl;
+		dev.run();
+	}
+	catch (std::exception const & e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+	}
+
+	return 1;
+}
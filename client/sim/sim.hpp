@@ -0,0 +1,154 @@
+#ifndef SHUPITO_SIM_SIM_HPP
+#define SHUPITO_SIM_SIM_HPP
+
+#include "../chipdefs.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+inline uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline uint64_t now_us()
+{
+	return now_ns() / 1000;
+}
+
+inline void sleep_until(uint64_t t)
+{
+	for (;;)
+	{
+		uint64_t n = now_us();
+		if (n >= t)
+			return;
+
+		timespec ts;
+		ts.tv_sec = (t - n) / 1000000;
+		ts.tv_nsec = ((t - n) % 1000000) * 1000;
+		nanosleep(&ts, 0);
+	}
+}
+
+inline void sleep_for(uint32_t us)
+{
+	if (us)
+		sleep_until(now_us() + us);
+}
+
+// Spends `ns` nanoseconds, the time a bit-level transfer takes on the wire.
+// The delays are too short to sleep through, so the time is spun away.
+inline void spin_for_ns(uint64_t ns)
+{
+	uint64_t t = now_ns() + ns;
+	while (now_ns() < t)
+	{
+	}
+}
+
+struct sim_options
+{
+	sim_options()
+		: chip("atxmega128a"), max_packet_size(15), max_out_payload(255), bandwidth(0),
+		page_write_us(4000), chip_erase_us(40000), pdi_max_khz(8000),
+		isp_max_khz(4000), isp_page_write_us(4500), isp_eeprom_write_us(3600), isp_fuse_write_us(4500),
+		isp_chip_erase_us(9000),
+		verbose(false), latency(false)
+	{
+	}
+
+	std::string chip;
+	std::string link;
+	uint8_t max_packet_size;
+
+	// The longest payload accepted from the client; zero makes
+	// the simulator ignore capability requests, like older programmers.
+	uint8_t max_out_payload;
+
+	// Link bandwidth in bytes per second, zero means unlimited.
+	uint32_t bandwidth;
+
+	// Latencies of the PDI target's NVM controller.
+	uint32_t page_write_us;
+	uint32_t chip_erase_us;
+
+	// The fastest PDI clock the target follows.
+	uint32_t pdi_max_khz;
+
+	// The fastest SCK the ISP target follows, a quarter of its clock.
+	uint32_t isp_max_khz;
+
+	// Latencies of the ISP target's NVM operations.
+	uint32_t isp_page_write_us;
+	uint32_t isp_eeprom_write_us;
+	uint32_t isp_fuse_write_us;
+	uint32_t isp_chip_erase_us;
+
+	bool verbose;
+
+	// Report each new worst-case time a command kept its handler busy,
+	// and how late pdi_t's compare alarms were taken meanwhile.
+	bool latency;
+};
+
+// The memories of the simulated target chip.
+struct sim_target
+{
+	explicit sim_target(chipdef const & cd)
+		: flash_page(0), eeprom_page(0), rdy_poll(!cd.no_rdy_poll)
+	{
+		std::string sig = cd.signature.substr(cd.signature.find(':') + 1);
+		for (std::size_t i = 0; i + 1 < sig.size(); i += 2)
+			signature.push_back((uint8_t)strtol(sig.substr(i, 2).c_str(), 0, 16));
+
+		pdi = cd.signature.compare(0, 5, "avrx:") == 0;
+
+		std::map<std::string, chipdef::memorydef>::const_iterator it = cd.memories.find("flash");
+		if (it != cd.memories.end())
+		{
+			flash.assign(it->second.size, 0xff);
+			flash_page = it->second.pagesize;
+		}
+
+		it = cd.memories.find("eeprom");
+		if (it != cd.memories.end())
+		{
+			eeprom.assign(it->second.size, 0xff);
+			eeprom_page = it->second.pagesize;
+		}
+
+		fuses.assign(pdi? 8: 4, 0xff);
+	}
+
+	void chip_erase()
+	{
+		std::fill(flash.begin(), flash.end(), 0xff);
+		std::fill(eeprom.begin(), eeprom.end(), 0xff);
+	}
+
+	static uint8_t read_byte(std::vector<uint8_t> const & mem, uint32_t addr)
+	{
+		return addr < mem.size()? mem[addr]: 0xff;
+	}
+
+	bool pdi;
+	std::vector<uint8_t> signature;
+	std::vector<uint8_t> flash;
+	std::vector<uint8_t> eeprom;
+	std::vector<uint8_t> fuses;
+
+	std::size_t flash_page;
+	std::size_t eeprom_page;
+
+	// Whether the ISP part answers Poll RDY/BSY.
+	bool rdy_poll;
+};
+
+#endif
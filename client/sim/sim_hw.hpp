@@ -0,0 +1,179 @@
+#ifndef SHUPITO_SIM_SIM_HW_HPP
+#define SHUPITO_SIM_SIM_HW_HPP
+
+// Host stand-ins for the hardware that fw_common's handlers and pdi_t
+// take as template parameters. The handlers run unmodified on top
+// of them, against the simulated targets; pdi_t drives the modelled
+// USARTC0 and DMA controller directly (sim_mcu.hpp).
+
+#include "sim.hpp"
+#include "sim_pdi_target.hpp"
+#include "sim_isp_target.hpp"
+#include <avr/io.h>
+
+// The timer's ticks. On the AVR, int is 16 bits wide and the handlers'
+// tick arithmetic wraps around with the timer; on the host, the operands
+// would be promoted to a wider int, so the differences are kept
+// to 16 bits explicitly.
+class sim_ticks
+{
+public:
+	sim_ticks(uint16_t value = 0)
+		: m_value(value)
+	{
+	}
+
+	operator uint16_t() const
+	{
+		return m_value;
+	}
+
+	sim_ticks & operator+=(sim_ticks rhs)
+	{
+		m_value += rhs.m_value;
+		return *this;
+	}
+
+	sim_ticks & operator-=(sim_ticks rhs)
+	{
+		m_value -= rhs.m_value;
+		return *this;
+	}
+
+private:
+	uint16_t m_value;
+};
+
+inline sim_ticks operator+(sim_ticks lhs, sim_ticks rhs) { return lhs += rhs; }
+inline sim_ticks operator+(sim_ticks lhs, int rhs) { return lhs += sim_ticks(rhs); }
+inline sim_ticks operator-(sim_ticks lhs, sim_ticks rhs) { return lhs -= rhs; }
+inline sim_ticks operator-(sim_ticks lhs, int rhs) { return lhs -= sim_ticks(rhs); }
+
+// shupito23's clock_t, TCE0 counting 8us ticks.
+struct sim_clock
+{
+	template <uint32_t v>
+	struct us { static const uint32_t value = (v + 7) >> 3; };
+
+	typedef sim_ticks time_type;
+	static const uint8_t value_bits = 16;
+
+	static void init()
+	{
+		TCE0_CTRLA = TC_CLKSEL_DIV256_gc;
+	}
+
+	static time_type value() { return (uint16_t)TCE0_CNT; }
+
+	static void alarm(time_type t)
+	{
+		TCE0_CCA = t;
+		TCE0_INTFLAGS = TC0_CCAIF_bm;
+		TCE0_INTCTRLB = TC_CCAINTLVL_MED_gc;
+	}
+
+	static void cancel_alarm() { TCE0_INTCTRLB = 0; }
+};
+
+// The main loop's background work. The simulator has none,
+// but the peripherals get their turn.
+struct sim_process
+{
+	void operator()() const
+	{
+		g_mcu.poll();
+	}
+};
+
+// The PDI_CLK pin, which doubles as the XMEGA target's reset line.
+struct sim_pdi_clk
+{
+	static void make_inverted() {}
+	static void make_noninverted() {}
+	static void make_low() {}
+	static void make_input() { g_mcu.pdi_release(); }
+};
+
+// The PDI_DATA pin; driving it high starts the PDI enable sequence.
+struct sim_pdi_data
+{
+	static void make_high() { g_mcu.pdi_enable(); }
+	static void make_input() {}
+	static void make_output() {}
+};
+
+// The activity LED. pdi_t::process drives it from the idle loops,
+// the peripherals get their turn there.
+struct sim_pdi_led
+{
+	void on() { g_mcu.poll(); }
+	void off() { g_mcu.poll(); }
+};
+
+// Stands in for the programmers' USART-based SPI master.
+class sim_spi
+{
+public:
+	typedef uint8_t error_t;
+
+	explicit sim_spi(sim_isp_target & target)
+		: m_target(target), m_byte_ns(0)
+	{
+	}
+
+	void clear()
+	{
+		m_byte_ns = 0;
+	}
+
+	error_t start_master(uint16_t bsel, uint8_t mode, bool lsb_first)
+	{
+		(void)mode;
+		(void)lsb_first;
+
+		uint32_t khz = F_CPU / 2000 / (bsel? bsel: 1);
+		m_byte_ns = 8000000ull / khz;
+		m_target.set_clock(khz);
+		return 0;
+	}
+
+	uint8_t send(uint8_t v)
+	{
+		if (!m_byte_ns)
+			return 0xff;
+
+		// The programmer spins on the USART while the byte is shifted,
+		// the peripherals catch up with the time it took.
+		spin_for_ns(m_byte_ns);
+		g_mcu.poll();
+		return m_target.transfer(v);
+	}
+
+	void start_transfer(uint8_t const * tx, uint8_t * rx, uint16_t len)
+	{
+		for (uint16_t i = 0; i < len; ++i)
+			rx[i] = this->send(tx[i]);
+	}
+
+	bool transfer_done()
+	{
+		return true;
+	}
+
+private:
+	sim_isp_target & m_target;
+	uint64_t m_byte_ns;
+};
+
+// The reset line of an ISP target; driven low, it holds the part in reset.
+struct sim_reset_pin
+{
+	static sim_isp_target * target;
+
+	static void make_low() { target->set_reset(true); }
+	static void set_low() { target->set_reset(true); }
+	static void set_high() { target->set_reset(false); }
+	static void make_input() { target->set_reset(false); }
+};
+
+#endif
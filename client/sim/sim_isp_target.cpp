@@ -0,0 +1,160 @@
+#include "sim_isp_target.hpp"
+
+sim_isp_target::sim_isp_target(sim_target & target, sim_options const & opts)
+	: m_target(target), m_opts(opts), m_reset(false), m_too_fast(false), m_synced(false), m_enabled(false), m_pos(0), m_out(0), m_busy_until(0)
+{
+	std::fill(m_instr, m_instr + 4, 0);
+	m_flash_buffer.assign((std::max)(target.flash_page, (std::size_t)2), 0xff);
+	m_eeprom_buffer.assign((std::max)(target.eeprom_page, (std::size_t)1), 0xff);
+	m_eeprom_loaded.assign(m_eeprom_buffer.size(), false);
+}
+
+void sim_isp_target::set_reset(bool active)
+{
+	if (active && !m_reset)
+	{
+		m_synced = !m_too_fast;
+		m_pos = 0;
+	}
+
+	if (!active)
+		m_enabled = false;
+	m_reset = active;
+}
+
+void sim_isp_target::set_clock(uint32_t khz)
+{
+	m_too_fast = khz > m_opts.isp_max_khz;
+	if (m_too_fast)
+		m_synced = false;
+}
+
+uint8_t sim_isp_target::transfer(uint8_t value)
+{
+	if (m_target.pdi || !m_reset || !m_synced)
+		return 0xff;
+
+	// The part echoes the previous byte while it receives
+	// the address, and shifts out the data with the last byte.
+	uint8_t res = m_pos == 0? m_out: m_pos == 3? this->read(m_instr): m_instr[m_pos - 1];
+
+	m_instr[m_pos++] = value;
+	if (m_pos == 4)
+	{
+		m_pos = 0;
+		m_out = m_instr[2];
+		this->execute(m_instr);
+	}
+
+	return res;
+}
+
+uint8_t sim_isp_target::read(uint8_t const * instr) const
+{
+	if (instr[0] == 0xF0) // Poll RDY/BSY
+		return m_target.rdy_poll? (this->busy()? 0x01: 0x00): 0xff;
+
+	if (!m_enabled || this->busy())
+		return 0xff;
+
+	uint16_t addr = (instr[1] << 8) | instr[2];
+	switch (instr[0])
+	{
+	case 0x30: // Read signature byte
+		return (instr[2] & 3) < m_target.signature.size()? m_target.signature[instr[2] & 3]: 0xff;
+	case 0x20: // Read program memory, low byte
+		return sim_target::read_byte(m_target.flash, addr * 2);
+	case 0x28: // Read program memory, high byte
+		return sim_target::read_byte(m_target.flash, addr * 2 + 1);
+	case 0xA0: // Read EEPROM
+		return sim_target::read_byte(m_target.eeprom, addr);
+	case 0x58: // Read lock bits, high fuse
+		return m_target.fuses[instr[1] == 0x08? 2: 0];
+	case 0x50: // Read low fuse, extended fuse
+		return m_target.fuses[instr[1] == 0x08? 3: 1];
+	default:
+		return 0x00;
+	}
+}
+
+void sim_isp_target::execute(uint8_t const * instr)
+{
+	if (instr[0] == 0xAC && instr[1] == 0x53)
+	{
+		m_enabled = true;
+		return;
+	}
+
+	// Instructions other than polls are lost while the part is busy.
+	if (!m_enabled || this->busy())
+		return;
+
+	uint16_t addr = (instr[1] << 8) | instr[2];
+	switch (instr[0])
+	{
+	case 0xAC:
+		switch (instr[1])
+		{
+		case 0x80: // Chip erase
+			m_target.chip_erase();
+			m_target.fuses[0] = 0xff;
+			this->set_busy(m_opts.isp_chip_erase_us);
+			break;
+		case 0xE0: // Write lock bits
+			m_target.fuses[0] = instr[3];
+			this->set_busy(m_opts.isp_fuse_write_us);
+			break;
+		case 0xA0: // Write low fuse
+			m_target.fuses[1] = instr[3];
+			this->set_busy(m_opts.isp_fuse_write_us);
+			break;
+		case 0xA8: // Write high fuse
+			m_target.fuses[2] = instr[3];
+			this->set_busy(m_opts.isp_fuse_write_us);
+			break;
+		case 0xA4: // Write extended fuse
+			m_target.fuses[3] = instr[3];
+			this->set_busy(m_opts.isp_fuse_write_us);
+			break;
+		}
+		break;
+	case 0x40: // Load program memory page, low byte
+	case 0x48: // Load program memory page, high byte
+		m_flash_buffer[(addr * 2 + (instr[0] == 0x48)) % m_flash_buffer.size()] = instr[3];
+		break;
+	case 0x4C: // Write program memory page
+		{
+			// Page programming doesn't erase, it can only clear bits.
+			uint32_t page = addr * 2 / m_flash_buffer.size() * m_flash_buffer.size();
+			for (std::size_t i = 0; i < m_flash_buffer.size() && page + i < m_target.flash.size(); ++i)
+				m_target.flash[page + i] &= m_flash_buffer[i];
+			m_flash_buffer.assign(m_flash_buffer.size(), 0xff);
+			this->set_busy(m_opts.isp_page_write_us);
+		}
+		break;
+	case 0xC0: // Write EEPROM memory
+		if (addr < m_target.eeprom.size())
+			m_target.eeprom[addr] = instr[3];
+		this->set_busy(m_opts.isp_eeprom_write_us);
+		break;
+	case 0xC1: // Load EEPROM memory page
+		{
+			std::size_t offset = addr % m_eeprom_buffer.size();
+			m_eeprom_buffer[offset] = instr[3];
+			m_eeprom_loaded[offset] = true;
+		}
+		break;
+	case 0xC2: // Write EEPROM memory page
+		{
+			uint32_t page = addr / m_eeprom_buffer.size() * m_eeprom_buffer.size();
+			for (std::size_t i = 0; i < m_eeprom_buffer.size() && page + i < m_target.eeprom.size(); ++i)
+			{
+				if (m_eeprom_loaded[i])
+					m_target.eeprom[page + i] = m_eeprom_buffer[i];
+			}
+			m_eeprom_loaded.assign(m_eeprom_loaded.size(), false);
+			this->set_busy(m_opts.isp_eeprom_write_us);
+		}
+		break;
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef SHUPITO_SIM_SIM_ISP_TARGET_HPP
+#define SHUPITO_SIM_SIM_ISP_TARGET_HPP
+
+#include "sim.hpp"
+
+// A classic AVR in the serial programming mode. The bytes shifted in
+// are decoded as the four-byte ISP instructions, the byte shifted out
+// in their place is the one the part would drive on MISO.
+class sim_isp_target
+{
+public:
+	sim_isp_target(sim_target & target, sim_options const & opts);
+
+	// The programmer drives the reset line low, or lets it go high.
+	// The part resynchronizes with the instruction framing on each reset.
+	void set_reset(bool active);
+
+	// The programmer clocks SCK at `khz`. A part clocked faster than
+	// it can follow misreads everything until its next reset.
+	void set_clock(uint32_t khz);
+
+	uint8_t transfer(uint8_t value);
+
+private:
+	uint8_t read(uint8_t const * instr) const;
+	void execute(uint8_t const * instr);
+
+	bool busy() const
+	{
+		return now_us() < m_busy_until;
+	}
+
+	void set_busy(uint32_t us)
+	{
+		m_busy_until = now_us() + us;
+	}
+
+	sim_target & m_target;
+	sim_options const & m_opts;
+
+	bool m_reset;
+	bool m_too_fast;
+	bool m_synced;
+	bool m_enabled;
+
+	uint8_t m_instr[4];
+	uint8_t m_pos;
+	uint8_t m_out;
+
+	std::vector<uint8_t> m_flash_buffer;
+	std::vector<uint8_t> m_eeprom_buffer;
+	std::vector<bool> m_eeprom_loaded;
+	uint64_t m_busy_until;
+};
+
+#endif
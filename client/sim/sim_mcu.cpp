@@ -0,0 +1,504 @@
+#include "sim_mcu.hpp"
+#include "sim_pdi_target.hpp"
+#include <avr/io.h>
+
+namespace {
+
+enum
+{
+	reg_usart_data,
+	reg_usart_status,
+	reg_usart_ctrla,
+	reg_usart_ctrlb,
+	reg_usart_ctrlc,
+	reg_usart_baudctrla,
+	reg_usart_baudctrlb,
+
+	reg_dma_ctrl = 0x10,
+
+	// Each channel's registers are at reg_dma_ch + 8 * ch.
+	reg_dma_ch = 0x20,
+	reg_dma_ch_ctrla = 0,
+	reg_dma_ch_ctrlb,
+	reg_dma_ch_addrctrl,
+	reg_dma_ch_trigsrc,
+	reg_dma_ch_trfcnt,
+
+	reg_tc_ctrla = 0x40,
+	reg_tc_intctrlb,
+	reg_tc_intflags,
+	reg_tc_cnt,
+	reg_tc_cca
+};
+
+// PDI frames have a start bit, 8 data bits, a parity bit and two stop bits.
+uint8_t const pdi_frame_bits = 12;
+
+// The timer runs at F_CPU / 256, the only prescaler modelled.
+uint64_t const tc_tick_ns = 256 * 1000000000ull / F_CPU;
+
+DMA_CH_t & dma_channel(uint8_t ch)
+{
+	return (&DMA.CH0)[ch];
+}
+
+}
+
+USART_t USARTC0;
+DMA_t DMA;
+TC0_t TCE0;
+uint8_t sim_sreg = 0x80;
+void (*sim_vectors[sim_vector_count])();
+sim_mcu g_mcu;
+
+sim_reg::operator uint8_t() const
+{
+	return (uint8_t)g_mcu.read(m_id);
+}
+
+sim_reg & sim_reg::operator=(uint8_t value)
+{
+	g_mcu.write(m_id, value);
+	return *this;
+}
+
+sim_reg16::operator uint16_t() const
+{
+	return g_mcu.read(m_id);
+}
+
+sim_reg16 & sim_reg16::operator=(uint16_t value)
+{
+	g_mcu.write(m_id, value);
+	return *this;
+}
+
+USART_t::USART_t()
+	: DATA(reg_usart_data), STATUS(reg_usart_status), CTRLA(reg_usart_ctrla), CTRLB(reg_usart_ctrlb),
+	CTRLC(reg_usart_ctrlc), BAUDCTRLA(reg_usart_baudctrla), BAUDCTRLB(reg_usart_baudctrlb)
+{
+}
+
+DMA_CH_t::DMA_CH_t(uint8_t ch)
+	: CTRLA(reg_dma_ch + 8 * ch + reg_dma_ch_ctrla), CTRLB(reg_dma_ch + 8 * ch + reg_dma_ch_ctrlb),
+	ADDRCTRL(reg_dma_ch + 8 * ch + reg_dma_ch_addrctrl), TRIGSRC(reg_dma_ch + 8 * ch + reg_dma_ch_trigsrc),
+	TRFCNT(reg_dma_ch + 8 * ch + reg_dma_ch_trfcnt)
+{
+}
+
+DMA_t::DMA_t()
+	: CTRL(reg_dma_ctrl), CH0(0), CH1(1), CH2(2), CH3(3)
+{
+}
+
+TC0_t::TC0_t()
+	: CTRLA(reg_tc_ctrla), INTCTRLB(reg_tc_intctrlb), INTFLAGS(reg_tc_intflags), CNT(reg_tc_cnt), CCA(reg_tc_cca)
+{
+}
+
+sim_mcu::sim_mcu()
+	: m_pdi_target(0), m_advancing(false), m_time(now_ns()),
+	m_usart_ctrla(0), m_usart_ctrlb(0), m_usart_ctrlc(0), m_usart_baud(0), m_txcif(false),
+	m_tx_shifting(false), m_tx_shift(0), m_tx_end(0), m_tx_buf_full(false), m_tx_buf(0),
+	m_rx_overflow(false), m_rx_end(0), m_dma_ctrl(0),
+	m_tc_ctrla(0), m_tc_intctrlb(0), m_tc_ccaif(false), m_tc_cca(0), m_tc_start(0), m_tc_alarm(0), m_tc_ccaif_time(0),
+	m_worst_alarm_delay(0)
+{
+	for (uint8_t ch = 0; ch < 4; ++ch)
+	{
+		m_dma_ctrla[ch] = 0;
+		m_dma_ctrlb[ch] = 0;
+		m_dma_addrctrl[ch] = 0;
+		m_dma_trigsrc[ch] = 0;
+		m_dma_trfcnt[ch] = 0;
+	}
+}
+
+void sim_mcu::attach_pdi(sim_pdi_target & target)
+{
+	m_pdi_target = &target;
+}
+
+void sim_mcu::pdi_enable()
+{
+	if (m_pdi_target)
+		m_pdi_target->enable(this->pdi_khz());
+}
+
+void sim_mcu::pdi_release()
+{
+	if (m_pdi_target)
+		m_pdi_target->disable();
+}
+
+void sim_mcu::poll()
+{
+	this->advance(now_ns());
+}
+
+uint64_t sim_mcu::next_event() const
+{
+	uint64_t res = 0;
+	if (m_tx_shifting)
+		res = m_tx_end;
+	if (m_rx_end && (!res || m_rx_end < res))
+		res = m_rx_end;
+	if (m_tc_ctrla && m_tc_intctrlb && (!res || m_tc_alarm < res))
+		res = m_tc_alarm;
+	return res;
+}
+
+void sim_mcu::sleep_until(uint64_t us)
+{
+	for (;;)
+	{
+		this->poll();
+		if (now_us() >= us)
+			return;
+
+		uint64_t next = this->next_event() / 1000;
+		::sleep_until(next && next < us? next: us);
+	}
+}
+
+uint64_t sim_mcu::take_worst_alarm_delay()
+{
+	uint64_t res = m_worst_alarm_delay;
+	m_worst_alarm_delay = 0;
+	return res;
+}
+
+uint16_t sim_mcu::read(uint16_t id)
+{
+	if (id >= reg_dma_ch && id < reg_dma_ch + 32)
+	{
+		uint8_t ch = (id - reg_dma_ch) / 8;
+		switch ((id - reg_dma_ch) % 8)
+		{
+		case reg_dma_ch_ctrla:
+			return m_dma_ctrla[ch];
+		case reg_dma_ch_ctrlb:
+			return m_dma_ctrlb[ch];
+		case reg_dma_ch_addrctrl:
+			return m_dma_addrctrl[ch];
+		case reg_dma_ch_trigsrc:
+			return m_dma_trigsrc[ch];
+		case reg_dma_ch_trfcnt:
+			return m_dma_trfcnt[ch];
+		}
+		return 0;
+	}
+
+	switch (id)
+	{
+	case reg_usart_data:
+		{
+			if (m_rx_fifo.empty())
+				return 0;
+			uint8_t res = m_rx_fifo.front();
+			m_rx_fifo.erase(m_rx_fifo.begin());
+			m_rx_overflow = false;
+			return res;
+		}
+	case reg_usart_status:
+		return (m_rx_fifo.empty()? 0: USART_RXCIF_bm)
+			| (m_txcif? USART_TXCIF_bm: 0)
+			| (m_tx_buf_full? 0: USART_DREIF_bm)
+			| (m_rx_overflow? USART_BUFOVF_bm: 0);
+	case reg_usart_ctrla:
+		return m_usart_ctrla;
+	case reg_usart_ctrlb:
+		return m_usart_ctrlb;
+	case reg_usart_ctrlc:
+		return m_usart_ctrlc;
+	case reg_usart_baudctrla:
+		return (uint8_t)m_usart_baud;
+	case reg_usart_baudctrlb:
+		return m_usart_baud >> 8;
+	case reg_dma_ctrl:
+		return m_dma_ctrl;
+	case reg_tc_ctrla:
+		return m_tc_ctrla;
+	case reg_tc_intctrlb:
+		return m_tc_intctrlb;
+	case reg_tc_intflags:
+		return m_tc_ccaif? TC0_CCAIF_bm: 0;
+	case reg_tc_cnt:
+		return m_tc_ctrla? (uint16_t)((m_time - m_tc_start) / tc_tick_ns): 0;
+	case reg_tc_cca:
+		return m_tc_cca;
+	}
+
+	return 0;
+}
+
+void sim_mcu::write(uint16_t id, uint16_t value)
+{
+	if (id >= reg_dma_ch && id < reg_dma_ch + 32)
+	{
+		uint8_t ch = (id - reg_dma_ch) / 8;
+		switch ((id - reg_dma_ch) % 8)
+		{
+		case reg_dma_ch_ctrla:
+			m_dma_ctrla[ch] = value;
+			break;
+		case reg_dma_ch_ctrlb:
+			// The interrupt flags are cleared by writing ones.
+			m_dma_ctrlb[ch] = (m_dma_ctrlb[ch] & ~value & (DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm))
+				| (value & ~(DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm));
+			break;
+		case reg_dma_ch_addrctrl:
+			m_dma_addrctrl[ch] = value;
+			break;
+		case reg_dma_ch_trigsrc:
+			m_dma_trigsrc[ch] = value;
+			break;
+		case reg_dma_ch_trfcnt:
+			m_dma_trfcnt[ch] = value;
+			break;
+		}
+	}
+
+	switch (id)
+	{
+	case reg_usart_data:
+		this->transmit(value);
+		break;
+	case reg_usart_status:
+		if (value & USART_TXCIF_bm)
+			m_txcif = false;
+		break;
+	case reg_usart_ctrla:
+		m_usart_ctrla = value;
+		break;
+	case reg_usart_ctrlb:
+		m_usart_ctrlb = value;
+		if ((value & USART_RXEN_bm) == 0)
+		{
+			m_rx_fifo.clear();
+			m_rx_overflow = false;
+			m_rx_end = 0;
+		}
+		break;
+	case reg_usart_ctrlc:
+		m_usart_ctrlc = value;
+		break;
+	case reg_usart_baudctrla:
+		m_usart_baud = (m_usart_baud & 0xff00) | (uint8_t)value;
+		break;
+	case reg_usart_baudctrlb:
+		m_usart_baud = (m_usart_baud & 0x00ff) | ((value & 0x0f) << 8);
+		break;
+	case reg_dma_ctrl:
+		m_dma_ctrl = value;
+		break;
+	case reg_tc_ctrla:
+		if (!m_tc_ctrla && value)
+			m_tc_start = m_time;
+		m_tc_ctrla = value;
+		m_tc_alarm = this->tc_tick_time(m_time);
+		break;
+	case reg_tc_intctrlb:
+		m_tc_intctrlb = value;
+		break;
+	case reg_tc_intflags:
+		if (value & TC0_CCAIF_bm)
+			m_tc_ccaif = false;
+		break;
+	case reg_tc_cca:
+		m_tc_cca = value;
+		m_tc_alarm = this->tc_tick_time(m_time);
+		break;
+	}
+
+	// A write may have enabled an interrupt, or the DMA.
+	this->advance(m_time);
+}
+
+void sim_mcu::advance(uint64_t now)
+{
+	if (m_advancing)
+		return;
+
+	m_advancing = true;
+	for (;;)
+	{
+		this->settle();
+		if (this->take_interrupt())
+			continue;
+
+		uint64_t t = this->next_event();
+		if (!t || t > now)
+			break;
+		this->run_event(t);
+	}
+
+	if (now > m_time)
+		m_time = now;
+	m_advancing = false;
+}
+
+// Makes the changes that take no time: DMA transfers triggered
+// by an empty data register and the start of a reception.
+void sim_mcu::settle()
+{
+	bool transferred = true;
+	while (transferred)
+	{
+		transferred = false;
+		for (uint8_t ch = 0; ch < 4; ++ch)
+		{
+			if ((m_dma_ctrl & DMA_ENABLE_bm) == 0 || (m_dma_ctrla[ch] & DMA_CH_ENABLE_bm) == 0
+				|| m_dma_trigsrc[ch] != DMA_CH_TRIGSRC_USARTC0_DRE_gc
+				|| (m_usart_ctrlb & USART_TXEN_bm) == 0 || m_tx_buf_full)
+			{
+				continue;
+			}
+
+			// Only the transfers pdi_t sets up are modelled: bytes
+			// from the memory to a fixed I/O register, one per trigger.
+			DMA_CH_t & regs = dma_channel(ch);
+			uint8_t value = *reinterpret_cast<uint8_t const *>(regs.SRCADDR0.value);
+			if ((m_dma_addrctrl[ch] & DMA_CH_SRCDIR_gm) == DMA_CH_SRCDIR_INC_gc)
+				++regs.SRCADDR0.value;
+			*reinterpret_cast<sim_reg *>(regs.DESTADDR0.value) = value;
+
+			if (--m_dma_trfcnt[ch] == 0)
+			{
+				m_dma_ctrla[ch] &= ~DMA_CH_ENABLE_bm;
+				m_dma_ctrlb[ch] |= DMA_CH_TRNIF_bm;
+			}
+
+			transferred = true;
+		}
+	}
+
+	// The target's answer is clocked in while the receiver listens.
+	if ((m_usart_ctrlb & USART_RXEN_bm) != 0 && !m_rx_end && m_pdi_target && m_pdi_target->response_ready())
+		m_rx_end = m_time + this->frame_ns();
+}
+
+bool sim_mcu::take_interrupt()
+{
+	if ((sim_sreg & 0x80) == 0)
+		return false;
+
+	uint8_t levels[sim_vector_count];
+	levels[USARTC0_RXC_vect] = m_rx_fifo.empty()? 0: (m_usart_ctrla >> 4) & 3;
+	levels[USARTC0_DRE_vect] = m_tx_buf_full? 0: m_usart_ctrla & 3;
+	levels[USARTC0_TXC_vect] = m_txcif? (m_usart_ctrla >> 2) & 3: 0;
+	levels[TCE0_CCA_vect] = m_tc_ccaif? m_tc_intctrlb & 3: 0;
+
+	// The highest level wins, then the lowest vector.
+	uint8_t vect = sim_vector_count;
+	for (uint8_t i = 0; i < sim_vector_count; ++i)
+	{
+		if (levels[i] && (vect == sim_vector_count || levels[i] > levels[vect]))
+			vect = i;
+	}
+
+	if (vect == sim_vector_count)
+		return false;
+
+	// The flags without a data register to empty
+	// are cleared as their interrupt is taken.
+	if (vect == USARTC0_TXC_vect)
+		m_txcif = false;
+	if (vect == TCE0_CCA_vect)
+	{
+		m_tc_ccaif = false;
+		m_worst_alarm_delay = (std::max)(m_worst_alarm_delay, now_ns() - m_tc_ccaif_time);
+	}
+
+	if (sim_vectors[vect])
+		sim_vectors[vect]();
+	return true;
+}
+
+void sim_mcu::run_event(uint64_t t)
+{
+	m_time = t;
+
+	if (m_tx_shifting && m_tx_end == t)
+	{
+		if (m_pdi_target)
+		{
+			// Whatever the target had left to say is lost
+			// once the programmer transmits again.
+			m_pdi_target->discard_responses();
+			m_pdi_target->set_clock(this->pdi_khz());
+			m_pdi_target->receive(m_tx_shift);
+		}
+
+		if (m_tx_buf_full)
+		{
+			m_tx_shift = m_tx_buf;
+			m_tx_buf_full = false;
+			m_tx_end = t + this->frame_ns();
+		}
+		else
+		{
+			m_tx_shifting = false;
+			m_txcif = true;
+		}
+	}
+
+	if (m_rx_end == t)
+	{
+		m_rx_end = 0;
+		if (m_pdi_target && m_pdi_target->response_ready())
+		{
+			uint8_t value = m_pdi_target->take_response();
+			if (m_rx_fifo.size() < 2)
+				m_rx_fifo.push_back(value);
+			else
+				m_rx_overflow = true;
+		}
+	}
+
+	if (m_tc_ctrla && m_tc_intctrlb && m_tc_alarm == t)
+	{
+		m_tc_ccaif = true;
+		m_tc_ccaif_time = t;
+		m_tc_alarm = this->tc_tick_time(t);
+	}
+}
+
+void sim_mcu::transmit(uint8_t value)
+{
+	if ((m_usart_ctrlb & USART_TXEN_bm) == 0)
+		return;
+
+	if (!m_tx_shifting)
+	{
+		m_tx_shifting = true;
+		m_tx_shift = value;
+		m_tx_end = m_time + this->frame_ns();
+	}
+	else
+	{
+		m_tx_buf = value;
+		m_tx_buf_full = true;
+	}
+}
+
+// In the synchronous mode, the USART clocks at F_CPU / (2 * (BSEL + 1)).
+uint32_t sim_mcu::pdi_khz() const
+{
+	return F_CPU / 2000 / (m_usart_baud + 1);
+}
+
+uint64_t sim_mcu::frame_ns() const
+{
+	return pdi_frame_bits * 2 * (m_usart_baud + 1) * 1000000000ull / F_CPU;
+}
+
+// Returns when the counter next matches CCA after `after`.
+uint64_t sim_mcu::tc_tick_time(uint64_t after) const
+{
+	uint64_t ticks = (after - m_tc_start) / tc_tick_ns;
+	uint64_t match = (ticks & ~(uint64_t)0xffff) | m_tc_cca;
+	if (match <= ticks)
+		match += 0x10000;
+	return m_tc_start + match * tc_tick_ns;
+}
@@ -0,0 +1,240 @@
+#ifndef SHUPITO_SIM_SIM_MCU_HPP
+#define SHUPITO_SIM_SIM_MCU_HPP
+
+// A register-level model of the programmer's XMEGA peripherals that
+// fw_common's pdi_t drives: USARTC0 as the synchronous PDI master,
+// the DMA controller and TCE0 with its compare interrupt. host/avr/io.h
+// maps avr-libc's register names onto the model, so that pdi.hpp
+// compiles for the host as it is.
+//
+// The peripherals run against the host's clock, but only catch up with it,
+// taking the interrupts that came due in their order, when the code
+// calls `poll` from its idle points. In between, the code runs in no time
+// as far as the peripherals are concerned, so a host that preempts
+// the simulator can't make it miss a compare match the MCU wouldn't.
+// Interrupts don't nest.
+
+#include "sim.hpp"
+
+class sim_pdi_target;
+
+// An 8-bit I/O register.
+class sim_reg
+{
+public:
+	explicit sim_reg(uint16_t id)
+		: m_id(id)
+	{
+	}
+
+	operator uint8_t() const;
+	sim_reg & operator=(uint8_t value);
+
+	sim_reg & operator|=(uint8_t value)
+	{
+		return *this = *this | value;
+	}
+
+	sim_reg & operator&=(uint8_t value)
+	{
+		return *this = *this & value;
+	}
+
+private:
+	sim_reg(sim_reg const &);
+	sim_reg & operator=(sim_reg const &);
+
+	uint16_t m_id;
+};
+
+// A 16-bit I/O register, accessed atomically.
+class sim_reg16
+{
+public:
+	explicit sim_reg16(uint16_t id)
+		: m_id(id)
+	{
+	}
+
+	operator uint16_t() const;
+	sim_reg16 & operator=(uint16_t value);
+
+private:
+	sim_reg16(sim_reg16 const &);
+	sim_reg16 & operator=(sim_reg16 const &);
+
+	uint16_t m_id;
+};
+
+// A byte of a DMA address. The host's pointers don't fit
+// the 24-bit addresses, so the whole value assigned to the lowest
+// byte is kept as the address and the higher bytes are ignored.
+struct sim_addr_reg
+{
+	sim_addr_reg()
+		: value(0)
+	{
+	}
+
+	sim_addr_reg & operator=(uintptr_t v)
+	{
+		value = v;
+		return *this;
+	}
+
+	uintptr_t value;
+};
+
+struct USART_t
+{
+	USART_t();
+
+	sim_reg DATA;
+	sim_reg STATUS;
+	sim_reg CTRLA;
+	sim_reg CTRLB;
+	sim_reg CTRLC;
+	sim_reg BAUDCTRLA;
+	sim_reg BAUDCTRLB;
+};
+
+struct DMA_CH_t
+{
+	explicit DMA_CH_t(uint8_t ch);
+
+	sim_reg CTRLA;
+	sim_reg CTRLB;
+	sim_reg ADDRCTRL;
+	sim_reg TRIGSRC;
+	sim_reg16 TRFCNT;
+	sim_addr_reg SRCADDR0;
+	sim_addr_reg SRCADDR1;
+	sim_addr_reg SRCADDR2;
+	sim_addr_reg DESTADDR0;
+	sim_addr_reg DESTADDR1;
+	sim_addr_reg DESTADDR2;
+};
+
+struct DMA_t
+{
+	DMA_t();
+
+	sim_reg CTRL;
+	DMA_CH_t CH0;
+	DMA_CH_t CH1;
+	DMA_CH_t CH2;
+	DMA_CH_t CH3;
+};
+
+struct TC0_t
+{
+	TC0_t();
+
+	sim_reg CTRLA;
+	sim_reg INTCTRLB;
+	sim_reg INTFLAGS;
+	sim_reg16 CNT;
+	sim_reg16 CCA;
+};
+
+extern USART_t USARTC0;
+extern DMA_t DMA;
+extern TC0_t TCE0;
+
+// The status register; only the global interrupt flag is modelled.
+extern uint8_t sim_sreg;
+
+enum
+{
+	USARTC0_RXC_vect,
+	USARTC0_DRE_vect,
+	USARTC0_TXC_vect,
+	TCE0_CCA_vect,
+	sim_vector_count
+};
+
+extern void (*sim_vectors[sim_vector_count])();
+
+class sim_mcu
+{
+public:
+	sim_mcu();
+
+	// The XMEGA at the far end of the PDI lines.
+	void attach_pdi(sim_pdi_target & target);
+
+	// PDI_DATA held high while the clock starts is the PDI enable
+	// sequence; releasing PDI_CLK, which doubles as the target's reset
+	// line, ends the PDI session.
+	void pdi_enable();
+	void pdi_release();
+
+	// Catches up with the host's clock and takes the pending interrupts.
+	void poll();
+
+	// When the next peripheral event is due, in nanoseconds,
+	// zero if none is.
+	uint64_t next_event() const;
+
+	// Sleeps until `us`, taking the interrupts that come due meanwhile.
+	void sleep_until(uint64_t us);
+
+	// The worst time a compare interrupt was taken late by, in ns.
+	uint64_t take_worst_alarm_delay();
+
+	uint16_t read(uint16_t id);
+	void write(uint16_t id, uint16_t value);
+
+private:
+	void advance(uint64_t now);
+	void settle();
+	bool take_interrupt();
+	void run_event(uint64_t t);
+
+	void transmit(uint8_t value);
+	uint32_t pdi_khz() const;
+	uint64_t frame_ns() const;
+	uint64_t tc_tick_time(uint64_t after) const;
+
+	sim_pdi_target * m_pdi_target;
+	bool m_advancing;
+	uint64_t m_time;
+
+	// USARTC0
+	uint8_t m_usart_ctrla;
+	uint8_t m_usart_ctrlb;
+	uint8_t m_usart_ctrlc;
+	uint16_t m_usart_baud;
+	bool m_txcif;
+	bool m_tx_shifting;
+	uint8_t m_tx_shift;
+	uint64_t m_tx_end;
+	bool m_tx_buf_full;
+	uint8_t m_tx_buf;
+	std::vector<uint8_t> m_rx_fifo;
+	bool m_rx_overflow;
+	uint64_t m_rx_end;
+
+	// DMA channels
+	uint8_t m_dma_ctrl;
+	uint8_t m_dma_ctrla[4];
+	uint8_t m_dma_ctrlb[4];
+	uint8_t m_dma_addrctrl[4];
+	uint8_t m_dma_trigsrc[4];
+	uint16_t m_dma_trfcnt[4];
+
+	// TCE0, counting from `m_tc_start`. The compare flag is only
+	// raised while its interrupt is enabled.
+	uint8_t m_tc_ctrla;
+	uint8_t m_tc_intctrlb;
+	bool m_tc_ccaif;
+	uint16_t m_tc_cca;
+	uint64_t m_tc_start;
+	uint64_t m_tc_alarm;
+	uint64_t m_tc_ccaif_time;
+	uint64_t m_worst_alarm_delay;
+};
+
+extern sim_mcu g_mcu;
+
+#endif
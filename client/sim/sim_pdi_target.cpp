@@ -0,0 +1,387 @@
+#include "sim_pdi_target.hpp"
+#include "../crc.hpp"
+
+namespace {
+
+uint32_t const nvm_base = 0x010001C0;
+uint32_t const flash_base = 0x800000;
+uint32_t const eeprom_base = 0x8C0000;
+uint32_t const fuse_base = 0x8F0020;
+
+uint64_t const nvm_key = 0x1289AB45CDD888FFull;
+
+uint32_t little_endian(std::vector<uint8_t> const & buf, std::size_t pos, std::size_t size)
+{
+	uint32_t res = 0;
+	for (std::size_t i = 0; i < size; ++i)
+		res |= (uint32_t)buf[pos + i] << (8 * i);
+	return res;
+}
+
+}
+
+sim_pdi_target::sim_pdi_target(sim_target & target, sim_options const & opts)
+	: m_target(target), m_opts(opts), m_enabled(false), m_synced(false), m_op(0), m_need(0), m_repeat(0), m_ptr(0),
+	m_nvm_enabled(false), m_reset(false), m_guard_time(0), m_run_start(0), m_busy_until(0)
+{
+	m_data.assign(0x10000, 0);
+	for (std::size_t i = 0; i < 4 && i < target.signature.size(); ++i)
+		m_data[0x90 + i] = target.signature[i];
+
+	std::fill(m_nvm, m_nvm + sizeof m_nvm, 0);
+	m_flash_buffer.assign((std::max)(target.flash_page, (std::size_t)1), 0xff);
+	m_eeprom_buffer.assign((std::max)(target.eeprom_page, (std::size_t)1), 0xff);
+	m_eeprom_loaded.assign(m_eeprom_buffer.size(), false);
+}
+
+void sim_pdi_target::enable(uint32_t khz)
+{
+	if (!m_target.pdi)
+		return;
+
+	if (!m_enabled)
+	{
+		m_enabled = true;
+		m_synced = true;
+		m_need = 0;
+		m_repeat = 0;
+		m_response.clear();
+	}
+
+	this->set_clock(khz);
+}
+
+void sim_pdi_target::set_clock(uint32_t khz)
+{
+	if (khz > m_opts.pdi_max_khz)
+		m_synced = false;
+}
+
+void sim_pdi_target::disable()
+{
+	if (m_enabled && m_reset)
+		m_run_start = now_us();
+
+	m_enabled = false;
+	m_synced = false;
+	m_nvm_enabled = false;
+	m_reset = false;
+	m_response.clear();
+}
+
+void sim_pdi_target::receive(uint8_t value)
+{
+	if (!m_enabled || !m_synced)
+		return;
+
+	if (m_need == 0)
+	{
+		this->start(value);
+	}
+	else
+	{
+		m_operand.push_back(value);
+		if (--m_need == 0)
+			this->execute();
+	}
+}
+
+void sim_pdi_target::start(uint8_t op)
+{
+	m_op = op;
+	m_operand.clear();
+
+	switch (op >> 5)
+	{
+	case 0: // LDS
+		m_need = ((op >> 2) & 3) + 1;
+		break;
+	case 1: // LD
+		{
+			uint8_t size = (op & 3) + 1;
+			for (uint32_t rep = 0; rep <= m_repeat; ++rep)
+			{
+				switch ((op >> 2) & 3)
+				{
+				case 0:
+				case 1:
+					for (uint8_t i = 0; i < size; ++i)
+						m_response.push_back(this->load(m_ptr + i));
+					if ((op >> 2) & 1)
+						m_ptr += size;
+					break;
+				case 2:
+					for (uint8_t i = 0; i < size; ++i)
+						m_response.push_back(m_ptr >> (8 * i));
+					break;
+				}
+			}
+			m_repeat = 0;
+		}
+		break;
+	case 2: // STS
+		m_need = ((op >> 2) & 3) + 1 + (op & 3) + 1;
+		break;
+	case 3: // ST
+		m_need = (op & 3) + 1;
+		break;
+	case 4: // LDCS
+		m_response.push_back(this->load_cs(op & 0x0f));
+		break;
+	case 5: // REPEAT
+		m_need = (op & 3) + 1;
+		break;
+	case 6: // STCS
+		m_need = 1;
+		break;
+	case 7: // KEY
+		m_need = 8;
+		break;
+	}
+}
+
+void sim_pdi_target::execute()
+{
+	switch (m_op >> 5)
+	{
+	case 0: // LDS
+		{
+			uint32_t addr = little_endian(m_operand, 0, m_operand.size());
+			for (uint8_t i = 0; i <= (m_op & 3); ++i)
+				m_response.push_back(this->load(addr + i));
+		}
+		break;
+	case 2: // STS
+		{
+			std::size_t addr_size = ((m_op >> 2) & 3) + 1;
+			uint32_t addr = little_endian(m_operand, 0, addr_size);
+			for (std::size_t i = addr_size; i < m_operand.size(); ++i)
+				this->store(addr + (i - addr_size), m_operand[i]);
+		}
+		break;
+	case 3: // ST
+		if (((m_op >> 2) & 3) == 2)
+		{
+			m_ptr = little_endian(m_operand, 0, m_operand.size());
+		}
+		else
+		{
+			for (std::size_t i = 0; i < m_operand.size(); ++i)
+				this->store(m_ptr + i, m_operand[i]);
+			if ((m_op >> 2) & 1)
+				m_ptr += m_operand.size();
+		}
+
+		// The repeated instruction takes its next operand.
+		if (m_repeat)
+		{
+			--m_repeat;
+			m_need = (m_op & 3) + 1;
+			m_operand.clear();
+			return;
+		}
+		break;
+	case 5: // REPEAT
+		m_repeat = little_endian(m_operand, 0, m_operand.size());
+		return;
+	case 6: // STCS
+		this->store_cs(m_op & 0x0f, m_operand[0]);
+		break;
+	case 7: // KEY
+		if (little_endian(m_operand, 0, 4) == (uint32_t)nvm_key
+			&& little_endian(m_operand, 4, 4) == (uint32_t)(nvm_key >> 32))
+		{
+			m_nvm_enabled = true;
+		}
+		break;
+	}
+
+	m_repeat = 0;
+}
+
+uint8_t sim_pdi_target::load_cs(uint8_t reg) const
+{
+	switch (reg)
+	{
+	case 0: // STATUS
+		return m_nvm_enabled? 0x02: 0x00;
+	case 1: // RESET
+		return m_reset? 0x01: 0x00;
+	case 2: // CTRL
+		return m_guard_time;
+	default:
+		return 0;
+	}
+}
+
+void sim_pdi_target::store_cs(uint8_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+	case 1:
+		if (m_reset && value != 0x59)
+			m_run_start = now_us();
+		m_reset = value == 0x59;
+		break;
+	case 2:
+		m_guard_time = value & 0x07;
+		break;
+	}
+}
+
+uint8_t sim_pdi_target::load(uint32_t addr) const
+{
+	if ((addr & 0xff000000) == 0x01000000)
+	{
+		addr &= 0xffff;
+		if (addr == 0x1CF) // NVM STATUS
+			return now_us() < m_busy_until? 0x80: 0x00;
+		if (addr >= 0x1C0 && addr < 0x1D0)
+			return m_nvm[addr - 0x1C0];
+
+		if (!m_reset && (addr == 0x2000 || addr == 0x2001))
+		{
+			uint16_t ms = (uint16_t)((now_us() - m_run_start) / 1000);
+			return addr == 0x2000? (uint8_t)ms: (uint8_t)(ms >> 8);
+		}
+
+		return m_data[addr];
+	}
+
+	// The NVM is only readable through the Read NVM commands
+	// once the key has been accepted.
+	uint8_t cmd = m_nvm[0x0A];
+	if (!m_nvm_enabled || (cmd != 0x43 && cmd != 0x06 && cmd != 0x07))
+		return 0xff;
+
+	if (addr >= fuse_base && addr < fuse_base + m_target.fuses.size())
+		return m_target.fuses[addr - fuse_base];
+	if (addr >= eeprom_base)
+		return sim_target::read_byte(m_target.eeprom, addr - eeprom_base);
+	if (addr >= flash_base)
+		return sim_target::read_byte(m_target.flash, addr - flash_base);
+	return 0xff;
+}
+
+void sim_pdi_target::store(uint32_t addr, uint8_t value)
+{
+	if ((addr & 0xff000000) == 0x01000000)
+	{
+		addr &= 0xffff;
+		if (addr >= 0x1C0 && addr < 0x1D0)
+		{
+			if (!m_nvm_enabled)
+				return;
+
+			m_nvm[addr - 0x1C0] = value;
+			if (addr == 0x1CB && (value & 0x01) != 0) // CTRLA.CMDEX
+				this->run_nvm_command();
+		}
+		else
+		{
+			m_data[addr] = value;
+		}
+		return;
+	}
+
+	// An NVM operation in progress ignores new ones.
+	if (!m_nvm_enabled || now_us() < m_busy_until)
+		return;
+
+	switch (m_nvm[0x0A])
+	{
+	case 0x23: // Load flash page buffer
+		if (addr >= flash_base)
+			m_flash_buffer[(addr - flash_base) % m_flash_buffer.size()] = value;
+		break;
+	case 0x33: // Load EEPROM page buffer
+		if (addr >= eeprom_base)
+		{
+			std::size_t offset = (addr - eeprom_base) % m_eeprom_buffer.size();
+			m_eeprom_buffer[offset] = value;
+			m_eeprom_loaded[offset] = true;
+		}
+		break;
+	case 0x2E: // Write flash page
+	case 0x2F: // Erase & write flash page
+		if (addr >= flash_base && addr < eeprom_base)
+		{
+			// A write without the erase can only clear bits.
+			bool erase = m_nvm[0x0A] == 0x2F;
+			uint32_t page = (addr - flash_base) / m_flash_buffer.size() * m_flash_buffer.size();
+			for (std::size_t i = 0; i < m_flash_buffer.size() && page + i < m_target.flash.size(); ++i)
+				m_target.flash[page + i] = erase? m_flash_buffer[i]: m_target.flash[page + i] & m_flash_buffer[i];
+			m_flash_buffer.assign(m_flash_buffer.size(), 0xff);
+			this->set_busy(erase? m_opts.page_write_us: m_opts.page_write_us / 2);
+		}
+		break;
+	case 0x34: // Write EEPROM page
+	case 0x35: // Erase & write EEPROM page
+		if (addr >= eeprom_base)
+		{
+			// Only the locations loaded into the buffer are written.
+			bool erase = m_nvm[0x0A] == 0x35;
+			uint32_t page = (addr - eeprom_base) / m_eeprom_buffer.size() * m_eeprom_buffer.size();
+			for (std::size_t i = 0; i < m_eeprom_buffer.size() && page + i < m_target.eeprom.size(); ++i)
+			{
+				if (m_eeprom_loaded[i])
+					m_target.eeprom[page + i] = erase? m_eeprom_buffer[i]: m_target.eeprom[page + i] & m_eeprom_buffer[i];
+			}
+			m_eeprom_buffer.assign(m_eeprom_buffer.size(), 0xff);
+			m_eeprom_loaded.assign(m_eeprom_loaded.size(), false);
+			this->set_busy(erase? m_opts.page_write_us: m_opts.page_write_us / 2);
+		}
+		break;
+	case 0x4C: // Write fuse
+		if (addr >= fuse_base && addr < fuse_base + m_target.fuses.size())
+		{
+			m_target.fuses[addr - fuse_base] = value;
+			this->set_busy(m_opts.page_write_us);
+		}
+		break;
+	}
+}
+
+void sim_pdi_target::run_nvm_command()
+{
+	if (now_us() < m_busy_until)
+		return;
+
+	switch (m_nvm[0x0A])
+	{
+	case 0x40: // Chip erase
+		m_target.chip_erase();
+		this->set_busy(m_opts.chip_erase_us);
+		break;
+	case 0x26: // Erase flash page buffer
+		m_flash_buffer.assign(m_flash_buffer.size(), 0xff);
+		break;
+	case 0x36: // Erase EEPROM page buffer
+		m_eeprom_buffer.assign(m_eeprom_buffer.size(), 0xff);
+		m_eeprom_loaded.assign(m_eeprom_loaded.size(), false);
+		break;
+	case 0x3A: // Flash range CRC, ADDR to DATA inclusive
+		{
+			// The controller always sums whole words.
+			uint32_t first = (m_nvm[0] | (m_nvm[1] << 8) | ((uint32_t)m_nvm[2] << 16)) & ~1;
+			uint32_t last = (m_nvm[4] | (m_nvm[5] << 8) | ((uint32_t)m_nvm[6] << 16)) | 1;
+
+			std::vector<uint8_t> range;
+			for (uint32_t i = first; i <= last; ++i)
+				range.push_back(sim_target::read_byte(m_target.flash, i));
+
+			uint32_t crc = nvm_crc24(range.begin(), range.end());
+			m_nvm[4] = (uint8_t)crc;
+			m_nvm[5] = (uint8_t)(crc >> 8);
+			m_nvm[6] = (uint8_t)(crc >> 16);
+		}
+		break;
+	}
+
+	m_nvm[0x0B] = 0;
+}
+
+void sim_pdi_target::set_busy(uint32_t us)
+{
+	m_busy_until = now_us() + us;
+}
@@ -0,0 +1,91 @@
+#ifndef SHUPITO_SIM_SIM_PDI_TARGET_HPP
+#define SHUPITO_SIM_SIM_PDI_TARGET_HPP
+
+#include "sim.hpp"
+#include <deque>
+
+// An XMEGA at the far end of the PDI lines. The bytes the programmer
+// transmits are decoded as PDI instructions, loads queue their data
+// as the bytes the target transmits back. Behind the instructions,
+// the NVM controller runs the commands it is given against the chip's
+// memories, keeping its busy flag set for the configured latencies.
+class sim_pdi_target
+{
+public:
+	sim_pdi_target(sim_target & target, sim_options const & opts);
+
+	// The programmer starts clocking the PDI at `khz`, or changes the clock.
+	// A target clocked faster than it can follow loses the frame
+	// synchronization and ignores everything until the PDI is disabled.
+	void enable(uint32_t khz);
+	void set_clock(uint32_t khz);
+
+	// The programmer released the PDI lines.
+	void disable();
+
+	void receive(uint8_t value);
+
+	bool response_ready() const
+	{
+		return !m_response.empty();
+	}
+
+	uint8_t take_response()
+	{
+		uint8_t res = m_response.front();
+		m_response.pop_front();
+		return res;
+	}
+
+	void discard_responses()
+	{
+		m_response.clear();
+	}
+
+private:
+	void start(uint8_t op);
+	void execute();
+
+	uint8_t load_cs(uint8_t reg) const;
+	void store_cs(uint8_t reg, uint8_t value);
+
+	uint8_t load(uint32_t addr) const;
+	void store(uint32_t addr, uint8_t value);
+	void run_nvm_command();
+
+	void set_busy(uint32_t us);
+
+	sim_target & m_target;
+	sim_options const & m_opts;
+
+	bool m_enabled;
+	bool m_synced;
+
+	// The instruction being received and the operand bytes
+	// still missing from it.
+	uint8_t m_op;
+	uint8_t m_need;
+	std::vector<uint8_t> m_operand;
+	uint32_t m_repeat;
+	uint32_t m_ptr;
+	std::deque<uint8_t> m_response;
+
+	// PDI control and status registers.
+	bool m_nvm_enabled;
+	bool m_reset;
+	uint8_t m_guard_time;
+
+	// The data space; while the target runs, its firmware keeps
+	// a 16-bit millisecond counter at the start of the SRAM.
+	std::vector<uint8_t> m_data;
+	uint64_t m_run_start;
+
+	// The NVM controller's registers at 0x1C0 and its page buffers.
+	uint8_t m_nvm[16];
+	uint64_t m_busy_until;
+	std::vector<uint8_t> m_flash_buffer;
+	std::vector<uint8_t> m_eeprom_buffer;
+	std::vector<bool> m_eeprom_loaded;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Smoke test of the client against the simulator: for a PDI and an ISP
+# chip, opens the pty, identifies the chip, then erases it, writes one
+# flash page and verifies it. Run `make` here and in the client first.
+
+cd "$(dirname "$0")"
+SIM=$PWD/shupito_sim
+CLIENT=$PWD/../avricsp
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Writes an Intel HEX file holding `size` bytes of a counting pattern.
+make_hex()
+{
+	awk -v size=$1 'BEGIN {
+		for (addr = 0; addr < size; addr += 16) {
+			line = sprintf("10%04X00", addr); sum = 16 + int(addr / 256) + addr % 256
+			for (i = 0; i < 16; ++i) { b = (addr + i) * 7 % 256; line = line sprintf("%02X", b); sum += b }
+			printf(":%s%02X\n", line, (256 - sum % 256) % 256)
+		}
+		print ":00000001FF"
+	}' > "$2"
+}
+
+# smoke <chip> <flash page size>
+smoke()
+{
+	local tty=$WORK/$1.tty
+	make_hex $2 "$WORK/$1.hex"
+
+	"$SIM" --chip $1 --link "$tty" > "$WORK/$1.log" 2>&1 &
+	local sim=$!
+	for i in $(seq 50); do [ -e "$tty" ] && break; sleep 0.1; done
+
+	# HOME is redirected so the client doesn't pick up cached settings.
+	HOME=$WORK timeout 60 "$CLIENT" "$tty" :chipid :erase :write flash --file="$WORK/$1.hex" --verify \
+		:verify flash --file="$WORK/$1.hex" > "$WORK/$1.out" 2>&1
+	local res=$?
+
+	kill $sim 2>/dev/null
+	wait $sim 2>/dev/null
+
+	if [ $res -ne 0 ] || ! grep -q "^id=$1 " "$WORK/$1.out" || ! grep -q "^verify: ok" "$WORK/$1.out"; then
+		echo "$1: FAILED"
+		cat "$WORK/$1.out" "$WORK/$1.log"
+		return 1
+	fi
+	echo "$1: ok"
+}
+
+res=0
+smoke atxmega128a 512 || res=1
+smoke atmega128 256 || res=1
+exit $res
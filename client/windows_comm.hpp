@@ -2,18 +2,33 @@
 #define WINDOWS_COMM_HPP
 
 #include <Windows.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <stdexcept>
 #include <stdint.h>
 
+struct comm_stats
+{
+	comm_stats()
+		: syscalls(0), bytes_read(0), bytes_written(0)
+	{
+	}
+
+	uint64_t syscalls;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
 class comm
 {
 public:
 	typedef uint8_t char_type;
 
 	comm()
-		: m_hFile(INVALID_HANDLE_VALUE)
+		: m_hFile(INVALID_HANDLE_VALUE), m_rx_first(0), m_rx_last(0)
 	{
+		m_rx_buffer.resize(rx_buffer_size);
 		m_hEvent = ::CreateEventA(0, FALSE, FALSE, 0);
 		if (!m_hEvent)
 			throw std::runtime_error("Failed to create a synchronization object.");
@@ -63,6 +78,7 @@ public:
 		while (first != last)
 		{
 			OVERLAPPED o = {};
+			++m_stats.syscalls;
 			if (!::WriteFile(m_hFile, first, last - first, 0, &o) && GetLastError() != ERROR_IO_PENDING)
 				throw std::runtime_error("Failed to write to the COM port.");
 
@@ -70,11 +86,77 @@ public:
 			if (!::GetOverlappedResult(m_hFile, &o, &dwWritten, TRUE))
 				throw std::runtime_error("Failed to write to the COM port.");
 			first += dwWritten;
+			m_stats.bytes_written += dwWritten;
+		}
+	}
+
+	void flush()
+	{
+	}
+
+	char_type const * rx_data() const
+	{
+		return &m_rx_buffer[m_rx_first];
+	}
+
+	std::size_t rx_size() const
+	{
+		return m_rx_last - m_rx_first;
+	}
+
+	void rx_consume(std::size_t size)
+	{
+		m_rx_first += size;
+		if (m_rx_first == m_rx_last)
+			m_rx_first = m_rx_last = 0;
+	}
+
+	bool rx_fill(int millisecs = -1)
+	{
+		if (m_rx_first != 0)
+		{
+			std::copy(m_rx_buffer.begin() + m_rx_first, m_rx_buffer.begin() + m_rx_last, m_rx_buffer.begin());
+			m_rx_last -= m_rx_first;
+			m_rx_first = 0;
+		}
+
+		if (m_rx_last == m_rx_buffer.size())
+			return true;
+
+		COMMTIMEOUTS ct = {};
+		ct.ReadIntervalTimeout = MAXDWORD;
+		ct.ReadTotalTimeoutMultiplier = MAXDWORD;
+		ct.ReadTotalTimeoutConstant = millisecs < 0? MAXDWORD - 1: (millisecs == 0? 1: millisecs);
+		SetCommTimeouts(m_hFile, &ct);
+
+		OVERLAPPED o = {};
+		o.hEvent = m_hEvent;
+		++m_stats.syscalls;
+		if (!::ReadFile(m_hFile, &m_rx_buffer[m_rx_last], m_rx_buffer.size() - m_rx_last, 0, &o)
+			&& GetLastError() != ERROR_IO_PENDING)
+		{
+			throw std::runtime_error("Failed to read from the COM port.");
 		}
+
+		DWORD dwRead;
+		if (!::GetOverlappedResult(m_hFile, &o, &dwRead, TRUE))
+			throw std::runtime_error("Failed to read from the COM port.");
+
+		ct = COMMTIMEOUTS();
+		SetCommTimeouts(m_hFile, &ct);
+
+		m_rx_last += dwRead;
+		m_stats.bytes_read += dwRead;
+		return dwRead != 0;
 	}
 
 	char_type * read(char_type * first, char_type * last, int microsecs = 0)
 	{
+		std::size_t buffered = (std::min)(this->rx_size(), (std::size_t)(last - first));
+		std::copy(this->rx_data(), this->rx_data() + buffered, first);
+		this->rx_consume(buffered);
+		first += buffered;
+
 		DWORD dwTimeBase = GetTickCount();
 		DWORD dwWaitTime = microsecs / 1000;
 
@@ -82,6 +164,7 @@ public:
 		{
 			OVERLAPPED o = {};
 			o.hEvent = m_hEvent;
+			++m_stats.syscalls;
 			if (!::ReadFile(m_hFile, first, last - first, 0, &o))
 			{
 				if (GetLastError() == ERROR_IO_PENDING)
@@ -102,6 +185,7 @@ public:
 				break;
 
 			first += dwRead;
+			m_stats.bytes_read += dwRead;
 		}
 		return first;
 	}
@@ -116,11 +200,25 @@ public:
 	void rx_clear()
 	{
 		::PurgeComm(m_hFile, PURGE_RXCLEAR);
+		m_rx_first = m_rx_last = 0;
+	}
+
+	comm_stats const & stats() const
+	{
+		return m_stats;
 	}
 
 private:
+	static const std::size_t rx_buffer_size = 16384;
+
 	HANDLE m_hFile;
 	HANDLE m_hEvent;
+
+	std::vector<char_type> m_rx_buffer;
+	std::size_t m_rx_first;
+	std::size_t m_rx_last;
+
+	comm_stats m_stats;
 	
 	comm(comm const &);
 	comm & operator=(comm const &);
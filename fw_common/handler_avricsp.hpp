@@ -4,6 +4,8 @@
 #include "handler_base.hpp"
 #include "avrlib/stopwatch.hpp"
 #include <avr/io.h>
+#include <util/crc16.h>
+#include <string.h>
 
 template <typename Spi, typename Clock, typename ResetPin, typename Process>
 class handler_avricsp
@@ -14,67 +16,43 @@ public:
 	typedef Clock clock_t;
 
 	handler_avricsp(spi_t & spi, clock_t & clock, Process process = Process())
-		: spi(spi), clock(clock), m_programming_enabled(false), m_process(process)
+		: spi(spi), clock(clock), m_programming_enabled(false), m_poll_ready(true), m_chip_erased(false), m_page_blank(true), m_eeprom_page_size(0), m_page_len(0), m_process(process)
 	{
 	}
 
 	void unselect()
 	{
 		spi.clear();
+		m_chip_erased = false;
+	}
+
+	uint16_t supported_commands() const
+	{
+		// PROGEN, leave, signature, READ, ERASE, WPREP, WFILL, WRITE, HASH
+		return 0x81FE;
 	}
 
 	bool handle_command(uint8_t cmd, uint8_t const * cp, uint8_t size, com_t & w)
 	{
 		switch (cmd)
 		{
-		case 1: // PROGEN 2'bsel
-			m_programming_enabled = false;
-
-			{
-				typename spi_t::error_t err = spi.start_master(cp[0] | (cp[1] << 8), /*mode=*/0, /*lsb_first=*/false);
-				if (err)
-				{
-					w.send_sync(1, &err, 1);
-					break;
-				}
-			}
-
-			// Pull down the reset line and send "Programming enable" sequence
-			ResetPin::make_low();
-			avrlib::wait(clock, Clock::template us<1000>::value, m_process);
-
-			ResetPin::set_high();
-			for (uint8_t i = 0; i < 3; ++i)
+		case 1: // PROGEN 2'bsel [1'flags] -> 1'error 2'bsel 2'khz
+			// flags: bit 0 -- the part doesn't implement Poll RDY/BSY,
+			//                 wait the worst-case time after NVM operations
 			{
-				avrlib::wait(clock, Clock::template us<1000>::value, m_process);
-				ResetPin::set_low();
-
-				// There has to be a 20ms delay on atmega128
-				avrlib::wait(clock, Clock::template us<20000>::value, m_process);
-
-				spi.send(0xAC);
-				spi.send(0x53);
-				uint8_t echo = spi.send(0x00);
-				spi.send(0x00);
+				m_chip_erased = false;
+				m_poll_ready = size < 3 || (cp[2] & 0x01) == 0;
 
-				if (echo == 0x53)
-				{
-					m_programming_enabled = true;
-					break;
-				}
-
-				ResetPin::set_high();
-			}
+				// A bsel of 0xFFFF asks for the fastest clock the target handles.
+				uint16_t bsel = cp[0] | (cp[1] << 8);
+				uint8_t error = bsel == 0xFFFF? this->enable_auto(bsel): this->enable(bsel);
 
-			if (!m_programming_enabled)
-			{
-				spi.clear();
-				ResetPin::make_input();
-			}
+				if (bsel == 0)
+					bsel = 1;
+				uint16_t khz = F_CPU / 2000 / bsel;
 
-			{
-				uint8_t err = !m_programming_enabled;
-				w.send_sync(1, &err, 1);
+				uint8_t buf[5] = { error, (uint8_t)bsel, (uint8_t)(bsel >> 8), (uint8_t)khz, (uint8_t)(khz >> 8) };
+				w.send_sync(1, buf, sizeof buf);
 			}
 			break;
 		case 2:
@@ -82,6 +60,7 @@ public:
 			spi.clear();
 			ResetPin::make_input();
 			m_programming_enabled = false;
+			m_chip_erased = false;
 
 			{
 				uint8_t err = 0;
@@ -125,50 +104,19 @@ public:
 				switch (memid)
 				{
 				case 1:
-					{
-						uint32_t addr = cp[1] | ((uint32_t)cp[2] << 8) | ((uint32_t)cp[3] << 16) | ((uint32_t)cp[4] << 24);
-						uint16_t size = cp[5] | ((uint32_t)cp[6] << 8);
-
-						for (;;)
-						{
-							uint8_t chunk = size > w.max_packet_size()? w.max_packet_size(): size;
-
-							uint8_t * wbuf = w.alloc_sync(4, chunk);
-							for (uint8_t i = chunk; i != 0; --i, ++addr)
-							{
-								// program memory words are sent in the little endian order
-								spi.send(addr & 1? 0x28: 0x20);
-								spi.send(addr >> 9);
-								m_process();
-								spi.send(addr >> 1);
-								*wbuf++ = spi.send(0);
-								m_process();
-							}
-							w.commit();
-
-							size -= chunk;
-							if (chunk < w.max_packet_size())
-								break;
-						}
-					}
-					break;
 				case 2: // EEPROM
 					{
-						uint16_t addr = cp[1] | (cp[2] << 8);
+						uint32_t addr = cp[1] | ((uint32_t)cp[2] << 8);
+						if (memid == 1)
+							addr |= ((uint32_t)cp[3] << 16) | ((uint32_t)cp[4] << 24);
 						uint16_t size = cp[5] | (cp[6] << 8);
+
 						for (;;)
 						{
 							uint8_t chunk = size > w.max_packet_size()? w.max_packet_size(): size;
 
 							uint8_t * wbuf = w.alloc_sync(4, chunk);
-							for (uint8_t i = chunk; i != 0; --i, ++addr)
-							{
-								spi.send(0xa0);
-								spi.send(addr >> 8);
-								spi.send(addr);
-								*wbuf++ = spi.send(0);
-								m_process();
-							}
+							this->read_stream(memid, addr, wbuf, chunk);
 							w.commit();
 
 							size -= chunk;
@@ -187,20 +135,21 @@ public:
 							{ 0x50, 0x08, 0x00 },
 						};
 
-						uint8_t addr = cp[1];
-						uint8_t size = cp[5];
+						// A single packet with the fuse bytes that exist
+						// in the requested range, possibly none.
+						uint8_t addr = cp[1] < 4 && cp[2] == 0 && cp[3] == 0 && cp[4] == 0? cp[1]: 4;
+						uint16_t size = cp[5] | (cp[6] << 8);
+						if (size > 4 - addr)
+							size = 4 - addr;
 
-						uint8_t * wbuf = w.alloc_sync(4, 4);
-						while (size && addr < 4)
+						uint8_t * wbuf = w.alloc_sync(4, size);
+						for (; size; ++addr, --size)
 						{
 							for (uint8_t j = 0; j < 3; ++j)
 								spi.send(commands[addr][j]);
 							*wbuf++ = spi.send(0);
-
-							++addr;
-							--size;
 						}
-						
+
 						w.commit();
 					}
 					break;
@@ -215,7 +164,8 @@ public:
 				spi.send(0);
 				spi.send(0);
 
-				avrlib::wait(clock, Clock::template us<100000>::value);
+				this->wait_ready(Clock::template us<100000>::value);
+				m_chip_erased = true;
 			}
 
 			{
@@ -224,7 +174,9 @@ public:
 			}
 			break;
 		case 6:
-			// WPREP 1'memid 4'addr
+			// WPREP 1'memid 4'addr [2'eeprom_page_size]
+			// EEPROM is written by pages if their size is given,
+			// byte by byte otherwise.
 			if (size >= 5)
 			{
 				uint8_t memid = cp[0];
@@ -233,6 +185,10 @@ public:
 				if (memid == 1 || memid == 2)
 				{
 					m_mempage_ptr = (cp[1]) | (cp[2] << 8);
+					m_page_start = cp[1] | (cp[2] << 8) | ((uint32_t)cp[3] << 16) | ((uint32_t)cp[4] << 24);
+					m_page_len = 0;
+					m_page_blank = true;
+					m_eeprom_page_size = memid == 2 && size >= 7? cp[5] | (cp[6] << 8): 0;
 					// TODO: potentially load the extended address byte
 				}
 				else if (memid == 3) // fuses
@@ -256,11 +212,30 @@ public:
 			{
 				bool success = true;
 
+				// The page is kept in `m_page_buf` as long as it fits,
+				// so that WRITE can verify it.
 				uint8_t memid = cp[0];
+				if (memid == 1 || memid == 2)
+				{
+					uint16_t page_end = m_page_len + (uint8_t)(size - 1);
+					if (page_end <= sizeof m_page_buf)
+						memcpy(m_page_buf + m_page_len, cp + 1, size - 1);
+					m_page_len = page_end;
+				}
+
 				if (memid == 1)
 				{
 					for (uint8_t i = 1; i < size; ++i)
 					{
+						// After a chip erase, the page buffer and the page
+						// both hold 0xff already.
+						if (m_chip_erased && cp[i] == 0xff)
+						{
+							++m_mempage_ptr;
+							continue;
+						}
+
+						m_page_blank = false;
 						spi.send(m_mempage_ptr & 1? 0x48: 0x40);
 						spi.send(0x00);
 						spi.send(m_mempage_ptr >> 1);
@@ -268,6 +243,17 @@ public:
 						++m_mempage_ptr;
 					}
 				}
+				else if (memid == 2 && m_eeprom_page_size) // eeprom page
+				{
+					for (uint8_t i = 1; i < size; ++i)
+					{
+						spi.send(0xc1);
+						spi.send(0x00);
+						spi.send(m_mempage_ptr & (m_eeprom_page_size - 1));
+						spi.send(cp[i]);
+						++m_mempage_ptr;
+					}
+				}
 				else if (memid == 2) // eeprom
 				{
 					for (uint8_t i = 1; i < size; ++i)
@@ -277,7 +263,7 @@ public:
 						spi.send(m_mempage_ptr);
 						spi.send(cp[i]);
 						++m_mempage_ptr;
-						avrlib::wait(clock, Clock::template us<10000>::value);
+						this->wait_ready(Clock::template us<10000>::value);
 					}
 				}
 				else if (memid == 3) // fuses
@@ -290,7 +276,7 @@ public:
 						spi.send(cmds[m_mempage_ptr++ & 0x3]);
 						spi.send(0x00);
 						spi.send(cp[i]);
-						avrlib::wait(clock, Clock::template us<5000>::value);
+						this->wait_ready(Clock::template us<5000>::value);
 					}
 				}
 				else
@@ -305,13 +291,25 @@ public:
 			}
 			break;
 		case 8:
-			// WRITE 1'memid 4'addr
-			if (size == 5)
+			// WRITE 1'memid 4'addr [1'flags]
+			// flags: bit 2 -- read the page back and compare it with the data
+			//                 loaded by WFILL; a mismatch is reported
+			//                 as 1'error=6 2'offset
+			// The other flags are ignored, ISP page writes never erase
+			// and always finish before the acknowledgement.
+			if (size == 5 || size == 6)
 			{
 				bool success = true;
+				uint8_t verify_error = 0;
+				uint16_t offset = 0;
 
 				uint8_t memid = cp[0];
-				if (memid == 1)
+				uint8_t flags = size == 6? cp[5]: 0;
+				if (memid == 1 && m_chip_erased && m_page_blank)
+				{
+					// Nothing was loaded, the erased page stays as it is.
+				}
+				else if (memid == 1)
 				{
 					uint16_t word_addr = (cp[1] >> 1) | (cp[2] << 7) | (cp[3] << 15);
 
@@ -319,8 +317,17 @@ public:
 					spi.send(word_addr >> 8);
 					spi.send(word_addr);
 					spi.send(0x00);
-				
-					avrlib::wait(clock, Clock::template us<5000>::value);
+
+					this->wait_ready(Clock::template us<5000>::value);
+				}
+				else if (memid == 2 && m_eeprom_page_size)
+				{
+					spi.send(0xC2);
+					spi.send(cp[2]);
+					spi.send(cp[1]);
+					spi.send(0x00);
+
+					this->wait_ready(Clock::template us<10000>::value);
 				}
 				else if (memid == 2 || memid == 3)
 				{
@@ -330,11 +337,59 @@ public:
 					success = false;
 				}
 
+				if (success && (memid == 1 || memid == 2) && (flags & 0x04))
+					verify_error = this->verify_page(memid, offset);
+
 				{
-					uint8_t err = !success;
-					w.send_sync(8, &err, 1);
+					uint8_t reply[3] = { success? verify_error: (uint8_t)1, (uint8_t)offset, (uint8_t)(offset >> 8) };
+					w.send_sync(8, reply, reply[0] == 6? 3: 1);
+				}
+			}
+			break;
+		case 15:
+			// HASH 1'op ... -> (1'op 1'error data)*
+			// op 0: 1'memid 4'addr 4'length 2'pagesize -- CRC-16/CCITT of every
+			//       page in the range, streamed over as many packets as needed
+			if (size == 12 && cp[0] == 0)
+			{
+				uint8_t memid = cp[1];
+				uint16_t page_size = cp[10] | (cp[11] << 8);
+				if ((memid == 1 || memid == 2) && page_size != 0)
+				{
+					uint32_t addr = cp[2] | ((uint32_t)cp[3] << 8) | ((uint32_t)cp[4] << 16) | ((uint32_t)cp[5] << 24);
+					uint32_t len = cp[6] | ((uint32_t)cp[7] << 8) | ((uint32_t)cp[8] << 16) | ((uint32_t)cp[9] << 24);
+
+					uint16_t remaining = (len + page_size - 1) / page_size;
+					uint8_t per_packet = (w.max_packet_size() - 2) / 2;
+					do
+					{
+						uint8_t count = remaining > per_packet? per_packet: (uint8_t)remaining;
+
+						uint8_t * wbuf = w.alloc_sync(15, 2 + 2 * count);
+						*wbuf++ = 0;
+						*wbuf++ = 0;
+						for (uint8_t i = 0; i < count; ++i)
+						{
+							uint16_t crc = this->page_crc(memid, addr, page_size);
+							*wbuf++ = crc;
+							*wbuf++ = crc >> 8;
+						}
+						w.commit();
+
+						remaining -= count;
+					}
+					while (remaining);
+				}
+				else
+				{
+					uint8_t reply[2] = { 0, 1 };
+					w.send_sync(15, reply, sizeof reply);
 				}
 			}
+			else
+			{
+				return false;
+			}
 			break;
 		default:
 			return false;
@@ -344,11 +399,263 @@ public:
 	}
 
 private:
+	uint8_t enable(uint16_t bsel)
+	{
+		m_programming_enabled = false;
+
+		typename spi_t::error_t err = spi.start_master(bsel, /*mode=*/0, /*lsb_first=*/false);
+		if (err)
+			return err;
+
+		// Pull down the reset line and send "Programming enable" sequence
+		ResetPin::make_low();
+		avrlib::wait(clock, Clock::template us<1000>::value, m_process);
+
+		ResetPin::set_high();
+		for (uint8_t i = 0; i < 3; ++i)
+		{
+			avrlib::wait(clock, Clock::template us<1000>::value, m_process);
+			ResetPin::set_low();
+
+			// There has to be a 20ms delay on atmega128
+			avrlib::wait(clock, Clock::template us<20000>::value, m_process);
+
+			spi.send(0xAC);
+			spi.send(0x53);
+			uint8_t echo = spi.send(0x00);
+			spi.send(0x00);
+
+			if (echo == 0x53)
+			{
+				m_programming_enabled = true;
+				break;
+			}
+
+			ResetPin::set_high();
+		}
+
+		if (!m_programming_enabled)
+		{
+			spi.clear();
+			ResetPin::make_input();
+		}
+
+		return !m_programming_enabled;
+	}
+
+	// Enables the programming mode at a clock slow enough for parts
+	// running from the 128 kHz oscillator and then doubles the clock
+	// for as long as the signature and the start of the flash read back
+	// unchanged. A clock that passes a few reads may still be marginal,
+	// so the programming mode is left enabled one step below the fastest
+	// clock that passed; the clock used is returned in `bsel`.
+	uint8_t enable_auto(uint16_t & bsel)
+	{
+		bsel = 512;
+		uint8_t error = this->enable(bsel);
+		if (error)
+			return error;
+
+		uint8_t ref[19];
+		this->read_probe(ref);
+
+		// A part that doesn't drive MISO reads back all 0x00 or all 0xff
+		// at any clock, which can't tell a good clock from a bad one.
+		// The search is then skipped and the safe clock kept.
+		uint8_t ones = 0xff;
+		uint8_t zeros = 0;
+		for (uint8_t i = 0; i < sizeof ref; ++i)
+		{
+			ones &= ref[i];
+			zeros |= ref[i];
+		}
+
+		if (ones == 0xff || zeros == 0)
+			return 0;
+
+		bool failed = false;
+		while (!failed && bsel > 1)
+		{
+			spi.start_master(bsel / 2, /*mode=*/0, /*lsb_first=*/false);
+			for (uint8_t i = 0; !failed && i < 4; ++i)
+			{
+				uint8_t probe[sizeof ref];
+				this->read_probe(probe);
+				failed = memcmp(probe, ref, sizeof ref) != 0;
+			}
+
+			if (!failed)
+				bsel /= 2;
+		}
+
+		if (bsel < 512)
+			bsel *= 2;
+
+		if (failed)
+		{
+			// The part may have lost the instruction framing,
+			// start over at the slower clock.
+			error = this->enable(bsel);
+		}
+		else
+		{
+			spi.start_master(bsel, /*mode=*/0, /*lsb_first=*/false);
+		}
+
+		return error;
+	}
+
+	// Reads the three signature bytes and the first 16 bytes of the flash.
+	void read_probe(uint8_t * buf)
+	{
+		for (uint8_t i = 0; i < 3; ++i)
+		{
+			spi.send(0x30);
+			spi.send(0x00);
+			spi.send(i);
+			*buf++ = spi.send(0x00);
+		}
+
+		uint32_t addr = 0;
+		this->read_stream(1, addr, buf, 16);
+	}
+
+	// Waits for the part to finish an NVM operation, at most `timeout`.
+	// Parts that can't be polled are given the whole `timeout`.
+	void wait_ready(typename clock_t::time_type timeout)
+	{
+		if (!m_poll_ready)
+		{
+			avrlib::wait(clock, timeout, m_process);
+			return;
+		}
+
+		typename clock_t::time_type t = clock.value();
+		for (;;)
+		{
+			// Poll RDY/BSY
+			spi.send(0xF0);
+			spi.send(0x00);
+			spi.send(0x00);
+			if ((spi.send(0x00) & 0x01) == 0 || clock.value() - t >= timeout)
+				break;
+			m_process();
+		}
+	}
+
+	// Stores the four-byte instruction that reads the byte at `addr`.
+	static void read_instruction(uint8_t memid, uint32_t addr, uint8_t * p)
+	{
+		if (memid == 1)
+		{
+			// program memory words are sent in the little endian order
+			p[0] = addr & 1? 0x28: 0x20;
+			p[1] = addr >> 9;
+			p[2] = addr >> 1;
+		}
+		else
+		{
+			p[0] = 0xa0;
+			p[1] = addr >> 8;
+			p[2] = addr;
+		}
+
+		p[3] = 0;
+	}
+
+	uint8_t read_byte(uint8_t memid, uint32_t addr)
+	{
+		uint8_t instr[4];
+		read_instruction(memid, addr, instr);
+		spi.send(instr[0]);
+		spi.send(instr[1]);
+		spi.send(instr[2]);
+		return spi.send(instr[3]);
+	}
+
+	// Reads `count` bytes from `addr` into `out` in batches. While one
+	// batch shifts, the instructions for the next one are built
+	// and the result of the previous one is extracted. The results
+	// replace the instructions in place, a byte is only received
+	// after it was sent.
+	void read_stream(uint8_t memid, uint32_t & addr, uint8_t * out, uint8_t count)
+	{
+		static uint8_t const batch = 16;
+		uint8_t buf[2][batch * 4];
+
+		uint8_t cur = 0;
+		uint8_t pending = 0;
+		while (count || pending)
+		{
+			uint8_t len = count > batch? batch: count;
+			for (uint8_t i = 0; i < len; ++i, ++addr)
+				read_instruction(memid, addr, buf[cur] + 4 * i);
+
+			while (!spi.transfer_done())
+				m_process();
+			if (len)
+				spi.start_transfer(buf[cur], buf[cur], len * 4);
+
+			uint8_t const * res = buf[!cur] + 3;
+			for (; pending; --pending, res += 4)
+				*out++ = *res;
+
+			pending = len;
+			count -= len;
+			cur = !cur;
+			m_process();
+		}
+	}
+
+	uint16_t page_crc(uint8_t memid, uint32_t & addr, uint16_t page_size)
+	{
+		uint16_t crc = 0xffff;
+		for (; page_size != 0; --page_size, ++addr)
+		{
+			crc = _crc_ccitt_update(crc, this->read_byte(memid, addr));
+			m_process();
+		}
+
+		return crc;
+	}
+
+	// Reads the page loaded by the last WFILLs back from the target
+	// and compares it with the copy in `m_page_buf`. Returns 6 and
+	// the offset of the first differing byte on a mismatch.
+	uint8_t verify_page(uint8_t memid, uint16_t & offset)
+	{
+		if (m_page_len > sizeof m_page_buf)
+			return 1;
+
+		for (offset = 0; offset < m_page_len; ++offset)
+		{
+			if (this->read_byte(memid, m_page_start + offset) != m_page_buf[offset])
+				return 6;
+			m_process();
+		}
+
+		return 0;
+	}
+
 	spi_t & spi;
 	clock_t & clock;
 
 	bool m_programming_enabled;
+	bool m_poll_ready;
+
+	// Set by a chip erase during this programming session; `m_page_blank`
+	// is cleared once a byte other than 0xff is loaded into the page.
+	bool m_chip_erased;
+	bool m_page_blank;
+
 	uint16_t m_mempage_ptr;
+	uint16_t m_eeprom_page_size;
+
+	// The page being loaded, kept for WRITE's verification.
+	uint32_t m_page_start;
+	uint16_t m_page_len;
+	uint8_t m_page_buf[256];
+
 	Process m_process;
 };
 
@@ -36,6 +36,10 @@ struct handler_base
 	virtual error_t select() { return 0; }
 	virtual void unselect() {}
 	virtual bool handle_command(uint8_t cmd, uint8_t const * cp, uint8_t size, com_t & com) { AVRLIB_ASSERT(0); return false; }
+
+	// A bitmap of the commands the handler understands, bit n standing
+	// for command n. Zero means the handler doesn't advertise them.
+	virtual uint16_t supported_commands() const { return 0; }
 	virtual void process_selected(com_t & com)
 	{
 		(void)com;
@@ -3,6 +3,8 @@
 
 #include "handler_base.hpp"
 #include "pdi_instr.hpp"
+#include <util/crc16.h>
+#include <string.h>
 
 template <typename Pdi, typename Clock, typename Process>
 class handler_xmega
@@ -13,59 +15,161 @@ public:
 	typedef Clock clock_t;
 
 	handler_xmega(pdi_t & pdi, clock_t & clock, Process process = Process())
-		: pdi(pdi), clock(clock), m_fuse_address(0), process(process)
+		: pdi(pdi), clock(clock), m_fuse_address(0), m_nvm_pending(false), m_page_deferred(false), m_page_len(0),
+		m_watch_running(false), m_watch_count(0), process(process)
 	{
 	}
 
 	void unselect()
 	{
 		pdi.clear();
+		m_nvm_pending = false;
+		m_page_deferred = false;
+		m_watch_running = false;
+		m_watch_count = 0;
 	}
 
-	bool handle_command(uint8_t cmd, uint8_t const * cp, uint8_t size, com_t & w)
+	uint16_t supported_commands() const
 	{
-		switch (cmd)
-		{
-		case 1: // PROGEN 2'bsel
-			{
-				// Enable programming mode
-				pdi.init(cp[0] | (cp[1] << 8));
-				while (!pdi.tx_ready())
-					process();
+		// PROGEN, leave, signature, READ, ERASE, WPREP, WFILL, WRITE, HASH, WATCH and SCRIPT
+		return 0x81FE;
+	}
 
-				uint8_t error = 0;
+	void process_selected(com_t & com)
+	{
+		if (!m_watch_running)
+			return;
 
-				pdi_stcs(pdi, 0x01, 0x59); // Ensure RESET
+		typename clock_t::time_type now = clock.value();
+		if ((int16_t)(now - m_watch_next) >= 0)
+		{
+			// Slots the main loop was too busy to take are lost.
+			m_watch_next += m_watch_period;
+			while ((int16_t)(now - m_watch_next) >= 0)
+			{
+				m_watch_next += m_watch_period;
+				++m_watch_dropped;
+			}
 
-				uint8_t reset = 0;
-				pdi_ldcs(pdi, 1, &reset);
-				error = pdi_wait_read(pdi, clock, process);
-				if (!error && (reset & 1) == 0)
-					error = 5;
+			uint16_t sample_end = m_watch_buffered + 2 + m_watch_size;
+			if (sample_end > sizeof m_page_buf)
+			{
+				++m_watch_dropped;
+			}
+			else
+			{
+				uint8_t * p = m_page_buf + m_watch_buffered;
+				*p++ = now;
+				*p++ = now >> 8;
 
-				if (!error)
+				uint8_t error = 0;
+				for (uint8_t i = 0; !error && i < m_watch_count; ++i)
 				{
-					pdi_key(pdi, 0x1289AB45CDD888FFull);
-					error = this->wait_for_nvm();
+					pdi_lds(pdi, (uint32_t)0x01000000 | m_watch_addr[i], m_watch_sizes[i], p);
+					error = pdi_wait_read(pdi, clock, process);
+					p += m_watch_sizes[i];
 				}
 
-				if (error != 0)
+				if (error)
+				{
+					uint8_t reply[2] = { 6, error };
+					m_watch_running = false;
 					pdi.clear();
+					com.send(15, reply, sizeof reply);
+					return;
+				}
 
-				w.send_sync(1, &error, 1);
+				m_watch_buffered = sample_end;
 			}
-			break;
-		case 2: // Leave programming mode
-			// Clear the RESET register first; otherwise the chip will be held in reset
-			// by the PDI controller until an external reset is issued.
-			if (pdi.enabled())
+		}
+
+		// Samples are sent once they fill a packet,
+		// or when the oldest one has waited for 10ms.
+		uint8_t sample_size = 2 + m_watch_size;
+		uint8_t per_packet = (com.max_packet_size() - 4) / sample_size;
+		uint16_t oldest = m_page_buf[0] | (m_page_buf[1] << 8);
+		if (m_watch_buffered == 0
+			|| (m_watch_buffered < per_packet * sample_size && now - oldest < Clock::template us<10000>::value))
+		{
+			return;
+		}
+
+		uint8_t chunk = m_watch_buffered < per_packet * sample_size? m_watch_buffered: per_packet * sample_size;
+		uint8_t * wbuf = com.alloc(15, chunk + 4);
+		if (!wbuf)
+			return;
+
+		*wbuf++ = 6;
+		*wbuf++ = 0;
+		*wbuf++ = m_watch_dropped;
+		*wbuf++ = m_watch_dropped >> 8;
+		memcpy(wbuf, m_page_buf, chunk);
+		com.commit();
+
+		m_watch_buffered -= chunk;
+		memmove(m_page_buf, m_page_buf + chunk, m_watch_buffered);
+	}
+
+	bool handle_command(uint8_t cmd, uint8_t const * cp, uint8_t size, com_t & w)
+	{
+		// Commands of the board, like shupito2's tunnels, are left
+		// to the caller without disturbing a pending write or the watch.
+		if (cmd > 15 || (this->supported_commands() & (1u << cmd)) == 0)
+			return false;
+
+		// Only page loads may overlap an asynchronous page write,
+		// everything else waits for it and reports its failure instead,
+		// in the form of its own reply. Leaving waits for it on its own.
+		if (m_nvm_pending && cmd > 2 && cmd != 6 && cmd != 7 && cmd != 8)
+		{
+			uint8_t error = this->finish_nvm();
+			if (error)
 			{
-				pdi_stcs(pdi, 0x01, 0x00);
-				pdi.clear();
+				this->send_error(cmd, cp, size, error, w);
+				return true;
 			}
+		}
+
+		// Any other command puts the watched target back into reset.
+		bool watch_op = cmd == 15 && size && cp[0] >= 2 && cp[0] <= 5;
+		if (m_watch_running && !watch_op)
+			this->stop_watch();
 
+		switch (cmd)
+		{
+		case 1: // PROGEN 2'bsel -> 1'error 2'bsel 2'khz
 			{
-				uint8_t error = 0;
+				m_nvm_pending = false;
+				m_page_deferred = false;
+				m_watch_running = false;
+				m_watch_count = 0;
+
+				// A bsel of 0xFFFF asks for the fastest clock the target handles.
+				uint16_t bsel = cp[0] | (cp[1] << 8);
+				uint8_t error = bsel == 0xFFFF? this->enable_auto(bsel): this->enable(bsel);
+
+				if (bsel == 0)
+					bsel = 1;
+				uint16_t khz = F_CPU / 2000 / bsel;
+
+				uint8_t buf[5] = { error, (uint8_t)bsel, (uint8_t)(bsel >> 8), (uint8_t)khz, (uint8_t)(khz >> 8) };
+				w.send_sync(1, buf, sizeof buf);
+			}
+			break;
+		case 2: // Leave programming mode
+			{
+				// A page write still running is waited for, the programming
+				// mode is left even if it failed.
+				uint8_t error = this->finish_nvm();
+
+				// Clear the RESET register first; otherwise the chip will be held in reset
+				// by the PDI controller until an external reset is issued.
+				if (pdi.enabled())
+				{
+					pdi_stcs(pdi, 0x01, 0x00);
+					pdi.clear();
+				}
+
 				w.send_sync(2, &error, 1);
 			}
 			break;
@@ -98,34 +202,81 @@ public:
 					pdi_st_ptr(pdi, addr);
 
 					uint16_t len = cp[5] | (cp[6] << 8);
+					uint8_t max_packet_size = w.max_packet_size();
 
-					while (error == 0)
+					// The target streams into `m_page_buf`, used as a ring,
+					// while the packets are sent from it. A READ ends any page
+					// load -- the NVM command and the pointer change anyway.
+					// Each REPEAT covers as much of the ring as is free
+					// up to its end, the bus only pauses between them.
+					m_page_deferred = false;
+					m_page_len = 0;
+
+					uint16_t started = 0;
+					uint16_t sent = 0;
+					uint16_t received = 0;
+					typename clock_t::time_type t = clock.value();
+					for (;;)
 					{
-						uint8_t max_packet_size = w.max_packet_size();
-						uint8_t chunk = len > max_packet_size? max_packet_size: (uint8_t)len;
-						if (error != 0)
-							chunk = 0;
+						uint16_t pending = pdi.read_count();
+						if (pending == 0 && started != len)
+						{
+							uint16_t pos = started % sizeof m_page_buf;
+							uint16_t count = sizeof m_page_buf - pos;
+							if (count > sizeof m_page_buf - (started - sent))
+								count = sizeof m_page_buf - (started - sent);
+							if (count > len - started)
+								count = len - started;
+							pdi_rep_ld(pdi, count, m_page_buf + pos);
+							started += count;
+							pending = count;
+							t = clock.value();
+						}
 
-						uint8_t * wbuf = w.alloc_sync(4, chunk);
-						pdi_rep_ld(pdi, chunk, wbuf);
-						error = pdi_wait_read(pdi, clock, process);
-						w.commit();
+						if (started - pending != received)
+						{
+							received = started - pending;
+							t = clock.value();
+						}
+
+						uint8_t chunk = len - sent > max_packet_size? max_packet_size: (uint8_t)(len - sent);
+						if (received - sent >= chunk)
+						{
+							uint16_t pos = sent % sizeof m_page_buf;
+							uint8_t first = sizeof m_page_buf - pos < chunk? (uint8_t)(sizeof m_page_buf - pos): chunk;
 
-						len -= chunk;
-						if (chunk < max_packet_size)
+							uint8_t * wbuf = w.alloc_sync(4, chunk);
+							memcpy(wbuf, m_page_buf + pos, first);
+							memcpy(wbuf + first, m_page_buf, chunk - first);
+							w.commit();
+
+							sent += chunk;
+							if (chunk < max_packet_size)
+								break;
+							continue;
+						}
+
+						if (clock.value() - t > Clock::template us<20000>::value)
+						{
+							error = 1;
 							break;
+						}
+						process();
 					}
 				}
 				else if (memid == 3)
 				{
-					uint8_t len = cp[5];
-					if (len > 8)
-						len = 8;
+					// A single packet with the fuse bytes that exist
+					// in the requested range, possibly none.
+					uint8_t addr = cp[1] < 8 && cp[2] == 0 && cp[3] == 0 && cp[4] == 0? cp[1]: 8;
+					uint16_t len = cp[5] | (cp[6] << 8);
+					if (len > 8 - addr)
+						len = 8 - addr;
 
 					pdi_sts(pdi, (uint32_t)0x010001CA, (uint8_t)0x07/*read fuse*/);
 
 					uint8_t * wbuf = w.alloc_sync(4, len);
-					error = pdi_ptrcopy(pdi, wbuf, 0x008F0020 | (cp[1] & 0x07), len, clock, process);
+					error = pdi_ptrcopy(pdi, wbuf, 0x008F0020 | addr, len, clock, process);
 					w.commit();
 				}
 				else
@@ -168,28 +319,25 @@ public:
 				if (memid == 1 || memid == 2)
 				{
 					uint32_t addr = cp[1] | ((uint16_t)cp[2] << 8) | ((uint32_t)cp[3] << 16) | ((uint32_t)cp[4] << 24);
-					addr += memid == 1? 0x800000: 0x8C0000;
+					m_page_memid = memid;
+					m_page_addr = addr;
+					m_page_len = 0;
 
-					// Erase page buffer
-					pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x26: (uint8_t)0x36);
-					pdi_sts(pdi, (uint32_t)0x010001CB, (uint8_t)0x01);
-
-					error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<10000>::value, process);
-					if (error)
-					{
-						pdi.clear();
-					}
+					// If the previous page is still being written, collect
+					// this one in SRAM until its WRITE arrives.
+					if (m_nvm_pending)
+						m_page_deferred = true;
 					else
-					{
-						// Load page buffer
-						pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x23: (uint8_t)0x33);
-						pdi_st_ptr(pdi, addr);
-					}
+						error = this->prepare_page(memid, addr);
 				}
 				else if (memid == 3)
 				{
-					pdi_sts(pdi, (uint32_t)0x010001CA, (uint8_t)0x4C/*write fuse*/);
-					m_fuse_address = cp[1];
+					error = this->finish_nvm();
+					if (!error)
+					{
+						pdi_sts(pdi, (uint32_t)0x010001CA, (uint8_t)0x4C/*write fuse*/);
+						m_fuse_address = cp[1];
+					}
 				}
 				else
 				{
@@ -209,11 +357,20 @@ public:
 				uint8_t memid = cp[0];
 				if (memid == 1 || memid == 2)
 				{
-					for (uint8_t i = 1; i < size; ++i)
+					// The page is kept in `m_page_buf` as long as it fits,
+					// so that WRITE can verify it.
+					uint16_t page_end = m_page_len + (uint8_t)(size - 1);
+					if (m_page_deferred && page_end > sizeof m_page_buf)
 					{
-						while (!pdi.tx_empty())
-							process();
-						pdi_st(pdi, cp[i]);
+						error = 1;
+					}
+					else
+					{
+						if (!m_page_deferred)
+							pdi_rep_st(pdi, size - 1, cp + 1);
+						if (page_end <= sizeof m_page_buf)
+							memcpy(m_page_buf + m_page_len, cp + 1, size - 1);
+						m_page_len = page_end;
 					}
 				}
 				else if (memid == 3)
@@ -234,24 +391,62 @@ public:
 			}
 			break;
 		case 8:
-			// WRITE 1'memid 4'addr
-			if (size == 5)
+			// WRITE 1'memid 4'addr [1'flags]
+			// flags: bit 0 -- the page is known to be blank, skip the erase
+			//        bit 1 -- acknowledge without waiting for the write to finish;
+			//                 the next page is collected in SRAM meanwhile and
+			//                 its WRITE, which needs the target's page buffer,
+			//                 does the wait rather than its WPREP
+			//        bit 2 -- read the page back and compare it with the data
+			//                 loaded by WFILL, implies a synchronous write;
+			//                 a mismatch is reported as 1'error=6 2'offset
+			if (size == 5 || size == 6)
 			{
 				uint8_t error = 0;
+				uint16_t offset = 0;
 
 				uint8_t memid = cp[0];
 				uint32_t addr = cp[1] | ((uint16_t)cp[2] << 8) | ((uint32_t)cp[3] << 16) | ((uint32_t)cp[4] << 24);
+				uint8_t flags = size == 6? cp[5]: 0;
 				if (memid == 1 || memid == 2)
 				{
-					addr += memid == 1? 0x800000: 0x8C0000;
+					// A page collected during the previous write
+					// can only be loaded now.
+					error = this->finish_nvm();
+					if (!error && m_page_deferred)
+					{
+						error = this->prepare_page(m_page_memid, m_page_addr);
+						for (uint16_t i = 0; !error && i < m_page_len; i += 255)
+							pdi_rep_st(pdi, m_page_len - i > 255? 255: (uint8_t)(m_page_len - i), m_page_buf + i);
+					}
+					m_page_deferred = false;
+
+					if (!error)
+					{
+						addr += memid == 1? 0x800000: 0x8C0000;
 
-					// CMD = Erase & Write Page
-					pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x2F: (uint8_t)0x35);
-					pdi_sts(pdi, addr, (uint8_t)0);
+						// CMD = Write Page or Erase & Write Page
+						uint8_t nvm_cmd;
+						if (memid == 1)
+							nvm_cmd = (flags & 0x01)? 0x2E: 0x2F;
+						else
+							nvm_cmd = (flags & 0x01)? 0x34: 0x35;
+						pdi_sts(pdi, (uint32_t)0x010001CA, nvm_cmd);
+						pdi_sts(pdi, addr, (uint8_t)0);
 
-					error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<50000>::value, process);
-					if (error)
-						pdi.clear();
+						if ((flags & 0x06) == 0x02)
+						{
+							m_nvm_pending = true;
+						}
+						else
+						{
+							error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<50000>::value, process);
+							if (error)
+								pdi.clear();
+							else if (flags & 0x04)
+								error = this->verify_page(offset);
+						}
+					}
 				}
 				else if (memid == 3)
 				{
@@ -265,7 +460,190 @@ public:
 					error = 1;
 				}
 
-				w.send_sync(8, &error, 1);
+				uint8_t reply[3] = { error, (uint8_t)offset, (uint8_t)(offset >> 8) };
+				w.send_sync(8, reply, error == 6? 3: 1);
+			}
+			break;
+
+		case 15:
+			// HASH, WATCH and SCRIPT 1'op ... -> (1'op 1'error data)*
+			// op 0: 1'memid 4'addr 4'length 2'pagesize -- CRC-16/CCITT of every
+			//       page in the range, streamed over as many packets as needed
+			// op 1: 1'memid 4'addr 4'length -- the NVM controller's 24-bit CRC
+			//       of a flash range
+			// op 2: stop and clear the watch list
+			// op 3: 2'addr 1'size -- add a data-space range to the list
+			// op 4: 2'period_us -- release the target from reset and
+			//       sample the list every period -> 2'ticks_per_ms
+			// op 5: script -- run a script of PDI instructions, see `run_script`,
+			//       the target may be watched meanwhile -> data
+			// The samples are streamed as op 6 with 2'dropped (2'timestamp data)*,
+			// a sample that fails to read ends the watch with the error.
+			// Command 9 carries shupito2's tunnels and 12 shupito23's button
+			// events, 15 is the one number no board uses for anything else.
+			if (size == 12 && cp[0] == 0)
+			{
+				uint8_t error = 0;
+
+				uint8_t memid = cp[1];
+				uint16_t page_size = cp[10] | (cp[11] << 8);
+				if ((memid == 1 || memid == 2) && page_size != 0)
+				{
+					uint32_t addr = cp[2] | ((uint16_t)cp[3] << 8) | ((uint32_t)cp[4] << 16);
+					uint32_t len = cp[6] | ((uint16_t)cp[7] << 8) | ((uint32_t)cp[8] << 16) | ((uint32_t)cp[9] << 24);
+
+					addr += memid == 1? 0x800000: 0x8C0000;
+
+					pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x43: (uint8_t)0x06);
+					pdi_st_ptr(pdi, addr);
+
+					uint16_t remaining = (len + page_size - 1) / page_size;
+					uint8_t per_packet = (w.max_packet_size() - 2) / 2;
+					do
+					{
+						uint8_t count = remaining > per_packet? per_packet: (uint8_t)remaining;
+
+						uint8_t * wbuf = w.alloc_sync(15, 2 + 2 * count);
+						for (uint8_t i = 0; !error && i < count; ++i)
+						{
+							uint16_t crc;
+							error = this->page_crc(page_size, crc);
+							wbuf[2 + 2 * i] = crc;
+							wbuf[3 + 2 * i] = crc >> 8;
+						}
+						wbuf[0] = 0;
+						wbuf[1] = error;
+						w.commit();
+
+						remaining -= count;
+					}
+					while (!error && remaining);
+				}
+				else
+				{
+					uint8_t reply[2] = { 0, 1 };
+					w.send_sync(15, reply, sizeof reply);
+				}
+
+				if (error)
+					pdi.clear();
+			}
+			else if (size == 10 && cp[0] == 1)
+			{
+				uint8_t reply[5] = { 1, 0 };
+				uint8_t & error = reply[1];
+
+				uint32_t addr = cp[2] | ((uint16_t)cp[3] << 8) | ((uint32_t)cp[4] << 16);
+				uint32_t len = cp[6] | ((uint16_t)cp[7] << 8) | ((uint32_t)cp[8] << 16) | ((uint32_t)cp[9] << 24);
+				if (cp[1] == 1 && len != 0)
+				{
+					uint32_t end = addr + len - 1;
+
+					// ADDR = start, DATA = end (inclusive), CMD = Flash Range CRC
+					pdi_sts(pdi, (uint32_t)0x010001C0, (uint16_t)addr);
+					pdi_sts(pdi, (uint32_t)0x010001C2, (uint8_t)(addr >> 16));
+					pdi_sts(pdi, (uint32_t)0x010001C4, (uint16_t)end);
+					pdi_sts(pdi, (uint32_t)0x010001C6, (uint8_t)(end >> 16));
+					pdi_sts(pdi, (uint32_t)0x010001CA, (uint8_t)0x3A);
+					pdi_sts(pdi, (uint32_t)0x010001CB, (uint8_t)0x01);
+
+					error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<200000>::value, process);
+					if (!error)
+					{
+						pdi_lds(pdi, (uint32_t)0x010001C4, 3, reply + 2);
+						error = pdi_wait_read(pdi, clock, process);
+					}
+				}
+				else
+				{
+					error = 1;
+				}
+
+				if (error)
+					pdi.clear();
+				w.send_sync(15, reply, error? 2: sizeof reply);
+			}
+			else if (size && cp[0] == 5)
+			{
+				// The data is read straight into the reply, whose size must
+				// be known upfront; a failed run still sends all of it.
+				uint16_t read_count;
+				if (check_script(cp + 1, cp + size, read_count) && read_count + 2 <= w.max_packet_size())
+				{
+					uint8_t * wbuf = w.alloc_sync(15, read_count + 2);
+					wbuf[0] = 5;
+					wbuf[1] = this->run_script(cp + 1, cp + size, wbuf + 2);
+					if (wbuf[1])
+						pdi.clear();
+					w.commit();
+				}
+				else
+				{
+					uint8_t reply[2] = { 5, 1 };
+					w.send_sync(15, reply, sizeof reply);
+				}
+			}
+			else if (watch_op)
+			{
+				uint16_t ticks_per_ms = Clock::template us<1000>::value;
+				uint8_t reply[4] = { cp[0], 0, (uint8_t)ticks_per_ms, (uint8_t)(ticks_per_ms >> 8) };
+				uint8_t reply_size = 2;
+
+				uint8_t & error = reply[1];
+				if (size == 1 && cp[0] == 2)
+				{
+					if (m_watch_running)
+						this->stop_watch();
+					m_watch_count = 0;
+				}
+				else if (size == 4 && cp[0] == 3)
+				{
+					uint8_t len = cp[3];
+					if (m_watch_count == sizeof m_watch_sizes || len == 0
+						|| (m_watch_count? m_watch_size: 0) + len > w.max_packet_size() - 6)
+					{
+						error = 1;
+					}
+					else
+					{
+						if (m_watch_count == 0)
+							m_watch_size = 0;
+						m_watch_addr[m_watch_count] = cp[1] | (cp[2] << 8);
+						m_watch_sizes[m_watch_count] = len;
+						m_watch_size += len;
+						++m_watch_count;
+					}
+				}
+				else if (size == 3 && cp[0] == 4)
+				{
+					uint32_t period = cp[1] | (cp[2] << 8);
+					period = period * Clock::template us<1000>::value / 1000;
+					if (!pdi.enabled() || m_watch_count == 0)
+					{
+						error = 1;
+					}
+					else
+					{
+						pdi_stcs(pdi, 0x01, 0x00); // Release RESET
+
+						m_watch_period = period? period: 1;
+						m_watch_next = clock.value();
+						m_watch_buffered = 0;
+						m_watch_dropped = 0;
+						m_watch_running = true;
+						reply_size = sizeof reply;
+					}
+				}
+				else
+				{
+					error = 1;
+				}
+
+				w.send_sync(15, reply, reply_size);
+			}
+			else
+			{
+				return false;
 			}
 			break;
 
@@ -277,6 +655,371 @@ public:
 	}
 
 private:
+	static uint32_t script_addr(uint8_t const * p)
+	{
+		return p[0] | ((uint16_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	// Checks that [first, last) is a well-formed script
+	// and counts the bytes it will read.
+	static bool check_script(uint8_t const * first, uint8_t const * last, uint16_t & read_count)
+	{
+		read_count = 0;
+		while (first != last)
+		{
+			uint16_t len;
+			switch (first[0])
+			{
+			case 0:
+				if (last - first < 6 || first[5] == 0 || first[5] > 4)
+					return false;
+				read_count += first[5];
+				len = 6;
+				break;
+			case 1:
+				len = 6;
+				break;
+			case 2:
+				read_count += 1;
+				len = 2;
+				break;
+			case 3:
+				len = 3;
+				break;
+			case 4:
+				len = 5;
+				break;
+			case 5:
+				if (last - first < 2 || first[1] == 0)
+					return false;
+				read_count += first[1];
+				len = 2;
+				break;
+			case 6:
+				if (last - first < 2 || first[1] == 0)
+					return false;
+				len = 2 + first[1];
+				break;
+			case 7:
+				len = 1;
+				break;
+			default:
+				return false;
+			}
+
+			if (last - first < len)
+				return false;
+			first += len;
+		}
+
+		return true;
+	}
+
+	// Runs a script checked by `check_script`, storing the bytes read into `out`.
+	// The instructions are
+	//   0 4'addr 1'count -- LDS, count is 1 to 4
+	//   1 4'addr 1'data  -- STS
+	//   2 1'reg          -- LDCS
+	//   3 1'reg 1'data   -- STCS
+	//   4 4'addr         -- ST ptr
+	//   5 1'count        -- REPEAT count-1; LD *ptr++
+	//   6 1'count data   -- REPEAT count-1; ST *ptr++
+	//   7                -- wait while the NVM controller is busy
+	// Each read is waited for before the next instruction is sent.
+	uint8_t run_script(uint8_t const * first, uint8_t const * last, uint8_t * out)
+	{
+		uint8_t error = 0;
+		while (!error && first != last)
+		{
+			switch (first[0])
+			{
+			case 0:
+				pdi_lds(pdi, script_addr(first + 1), first[5], out);
+				error = pdi_wait_read(pdi, clock, process);
+				out += first[5];
+				first += 6;
+				break;
+			case 1:
+				pdi_sts(pdi, script_addr(first + 1), first[5]);
+				first += 6;
+				break;
+			case 2:
+				pdi_ldcs(pdi, first[1], out++);
+				error = pdi_wait_read(pdi, clock, process);
+				first += 2;
+				break;
+			case 3:
+				pdi_stcs(pdi, first[1], first[2]);
+				first += 3;
+				break;
+			case 4:
+				pdi_st_ptr(pdi, script_addr(first + 1));
+				first += 5;
+				break;
+			case 5:
+				pdi_rep_ld(pdi, first[1], out);
+				error = pdi_wait_read(pdi, clock, process);
+				out += first[1];
+				first += 2;
+				break;
+			case 6:
+				pdi_rep_st(pdi, first[1], first + 2);
+				first += 2 + first[1];
+				break;
+			case 7:
+				error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<200000>::value, process);
+				++first;
+				break;
+			}
+		}
+
+		return error;
+	}
+
+	// Ends the watch mode and holds the target in reset again.
+	void stop_watch()
+	{
+		m_watch_running = false;
+		if (pdi.enabled())
+		{
+			pdi_stcs(pdi, 0x01, 0x59);
+			this->wait_for_nvm();
+		}
+	}
+
+	// Enables the programming mode with the PDI clock at F_CPU / (2 * bsel).
+	uint8_t enable(uint16_t bsel)
+	{
+		// A `clear`, e.g. by the previous leave, may still be releasing
+		// the lines, `init` would then leave them released.
+		while (!pdi.enabled() && !pdi.released())
+			process();
+
+		pdi.init(bsel);
+		while (!pdi.tx_ready())
+			process();
+
+		uint8_t error = 0;
+
+		pdi_stcs(pdi, 0x01, 0x59); // Ensure RESET
+
+		uint8_t reset = 0;
+		pdi_ldcs(pdi, 1, &reset);
+		error = pdi_wait_read(pdi, clock, process);
+		if (!error && (reset & 1) == 0)
+			error = 5;
+
+		if (!error)
+		{
+			pdi_key(pdi, 0x1289AB45CDD888FFull);
+			error = this->wait_for_nvm();
+		}
+
+		if (error != 0)
+			pdi.clear();
+
+		return error;
+	}
+
+	// Enables the programming mode at a conservative clock and then
+	// doubles the clock for as long as the signature and the start
+	// of the flash read back unchanged and without line errors.
+	// A clock that passes a few reads may still be marginal, so the
+	// programming mode is left enabled one step below the fastest
+	// clock that passed; the clock used is returned in `bsel`.
+	uint8_t enable_auto(uint16_t & bsel)
+	{
+		bsel = 64;
+		uint8_t error = this->enable(bsel);
+		if (error)
+			return error;
+
+		// Only reads are issued at the untested clocks,
+		// so that a misheard byte can't start an NVM operation.
+		pdi_sts(pdi, (uint32_t)0x010001CA, (uint8_t)0x43);
+
+		uint8_t ref[20];
+		error = this->read_probe(ref);
+		if (error)
+		{
+			pdi.clear();
+			return error;
+		}
+
+		bool failed = false;
+		while (!failed && bsel > 1)
+		{
+			pdi.set_bsel(bsel / 2);
+			for (uint8_t i = 0; !failed && i < 4; ++i)
+			{
+				uint8_t probe[sizeof ref];
+				failed = this->read_probe(probe) != 0 || memcmp(probe, ref, sizeof ref) != 0;
+			}
+
+			if (!failed)
+				bsel /= 2;
+		}
+
+		if (bsel < 64)
+			bsel *= 2;
+
+		if (failed)
+		{
+			// The target may have lost the frame synchronization,
+			// start over at the slower clock.
+			pdi.clear();
+			error = this->enable(bsel);
+		}
+		else
+		{
+			pdi.set_bsel(bsel);
+		}
+
+		return error;
+	}
+
+	// Reads the signature and the first 16 bytes of the flash,
+	// the NVM must be set up for flash reads.
+	uint8_t read_probe(uint8_t * buf)
+	{
+		pdi.take_rx_errors();
+
+		pdi_lds(pdi, (uint32_t)0x01000090, 4, buf);
+		uint8_t error = pdi_wait_read(pdi, clock, process);
+		if (!error)
+		{
+			pdi_st_ptr(pdi, (uint32_t)0x800000);
+			pdi_rep_ld(pdi, 16, buf + 4);
+			error = pdi_wait_read(pdi, clock, process);
+		}
+
+		if (!error && pdi.take_rx_errors() != 0)
+			error = 1;
+		return error;
+	}
+
+	// Replies to `cmd` with `error` the way the command reports
+	// its own failures; READ reports them as command 2.
+	void send_error(uint8_t cmd, uint8_t const * cp, uint8_t size, uint8_t error, com_t & w)
+	{
+		switch (cmd)
+		{
+		case 3:
+			{
+				uint8_t buf[5] = { 0, 0, 0, 0, error };
+				w.send_sync(3, buf, sizeof buf);
+			}
+			break;
+		case 4:
+			w.send_sync(2, &error, 1);
+			break;
+		case 15:
+			{
+				uint8_t reply[2] = { size? cp[0]: (uint8_t)0, error };
+				w.send_sync(15, reply, sizeof reply);
+			}
+			break;
+		default:
+			w.send_sync(cmd, &error, 1);
+			break;
+		}
+	}
+
+	// Waits for the page write started by an asynchronous WRITE.
+	uint8_t finish_nvm()
+	{
+		if (!m_nvm_pending)
+			return 0;
+
+		m_nvm_pending = false;
+		uint8_t error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<50000>::value, process);
+		if (error)
+			pdi.clear();
+		return error;
+	}
+
+	// Erases the page buffer and points the PDI pointer
+	// to `addr`, so that the page can be loaded.
+	uint8_t prepare_page(uint8_t memid, uint32_t addr)
+	{
+		addr += memid == 1? 0x800000: 0x8C0000;
+
+		// Erase page buffer
+		pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x26: (uint8_t)0x36);
+		pdi_sts(pdi, (uint32_t)0x010001CB, (uint8_t)0x01);
+
+		uint8_t error = pdi_wait_nvm_busy(pdi, clock, Clock::template us<10000>::value, process);
+		if (error)
+		{
+			pdi.clear();
+		}
+		else
+		{
+			// Load page buffer
+			pdi_sts(pdi, (uint32_t)0x010001CA, memid == 1? (uint8_t)0x23: (uint8_t)0x33);
+			pdi_st_ptr(pdi, addr);
+		}
+
+		return error;
+	}
+
+	// Reads the page loaded by the last WFILLs back from the target
+	// and compares it with the copy in `m_page_buf`. Returns 6 and
+	// the offset of the first differing byte on a mismatch.
+	uint8_t verify_page(uint16_t & offset)
+	{
+		offset = 0;
+		if (m_page_len > sizeof m_page_buf)
+			return 1;
+
+		pdi_sts(pdi, (uint32_t)0x010001CA, m_page_memid == 1? (uint8_t)0x43: (uint8_t)0x06);
+		pdi_st_ptr(pdi, m_page_addr + (m_page_memid == 1? 0x800000: 0x8C0000));
+
+		uint8_t buf[16];
+		while (offset < m_page_len)
+		{
+			uint16_t left = m_page_len - offset;
+			uint8_t chunk = left > sizeof buf? sizeof buf: (uint8_t)left;
+			pdi_rep_ld(pdi, chunk, buf);
+			uint8_t error = pdi_wait_read(pdi, clock, process);
+			if (error)
+			{
+				pdi.clear();
+				return error;
+			}
+
+			for (uint8_t i = 0; i < chunk; ++i, ++offset)
+			{
+				if (buf[i] != m_page_buf[offset])
+					return 6;
+			}
+		}
+
+		return 0;
+	}
+
+	// Reads the next `page_size` bytes from the PDI pointer
+	// and computes their CRC.
+	uint8_t page_crc(uint16_t page_size, uint16_t & crc)
+	{
+		uint8_t buf[16];
+		uint8_t error = 0;
+
+		crc = 0xffff;
+		while (!error && page_size)
+		{
+			uint8_t chunk = page_size > sizeof buf? sizeof buf: (uint8_t)page_size;
+			pdi_rep_ld(pdi, chunk, buf);
+			error = pdi_wait_read(pdi, clock, process);
+
+			for (uint8_t i = 0; i < chunk; ++i)
+				crc = _crc_ccitt_update(crc, buf[i]);
+			page_size -= chunk;
+		}
+
+		return error;
+	}
+
 	uint8_t wait_for_nvm()
 	{
 		uint8_t error = 0;
@@ -302,6 +1045,31 @@ private:
 
 	uint8_t m_fuse_address;
 
+	// Set while a page write started by an asynchronous WRITE
+	// may still be running on the target.
+	bool m_nvm_pending;
+
+	// The page being loaded, a copy of its data is kept in `m_page_buf`.
+	// `m_page_deferred` is set when WPREP arrived during such a write;
+	// the page is then only collected and loaded once the write finishes.
+	bool m_page_deferred;
+	uint8_t m_page_memid;
+	uint32_t m_page_addr;
+	uint16_t m_page_len;
+	uint8_t m_page_buf[512];
+
+	// The watch list, sampled while the target runs. The samples
+	// are collected in `m_page_buf`, which no page write needs then.
+	bool m_watch_running;
+	uint8_t m_watch_count;
+	uint16_t m_watch_addr[8];
+	uint8_t m_watch_sizes[8];
+	uint8_t m_watch_size;
+	typename clock_t::time_type m_watch_period;
+	typename clock_t::time_type m_watch_next;
+	uint16_t m_watch_buffered;
+	uint16_t m_watch_dropped;
+
 	Process process;
 };
 
@@ -3,12 +3,19 @@
 
 #include "avrlib/buffer.hpp"
 
-template <typename Clock, typename PdiClk, typename PdiData, typename Led>
+// The Clock must provide `alarm(t)`, which raises a compare interrupt
+// once the clock reaches `t`, and `cancel_alarm()`. The interrupt
+// must call `intr_alarm`, which makes all the timed state transitions,
+// so that they don't depend on how often the main loop runs.
+//
+// `write_bulk` borrows the DMA channel `DmaCh`, which must not be in use
+// while the PDI is, and the DMA controller must already be enabled.
+template <typename Clock, typename PdiClk, typename PdiData, typename Led, uint8_t DmaCh>
 class pdi_t
 {
 public:
 	explicit pdi_t(Clock & clock)
-		: m_clock(clock), m_state(st_disabled)
+		: m_clock(clock), m_rx_errors(0), m_state(st_disabled)
 	{
 	}
 
@@ -24,16 +31,22 @@ public:
 		// A few more clocks should be supplied
 		// to make sure that the last byte was received correctly
 		m_state = st_unrst;
-		m_time_base = m_clock.value();
+		this->schedule(Clock::template us<100>::value);
 		m_led.off();
 	}
 
-	void init(uint16_t bsel)
+	// Changes the PDI clock, may be called between transfers.
+	void set_bsel(uint16_t bsel)
 	{
 		if (bsel)
 			--bsel;
 		USARTC0_BAUDCTRLA = bsel;
 		USARTC0_BAUDCTRLB = bsel >> 8;
+	}
+
+	void init(uint16_t bsel)
+	{
+		this->set_bsel(bsel);
 
 		if (m_state != st_disabled)
 			return;
@@ -52,13 +65,13 @@ public:
 		// chip's buskeeper to properly transmit.
 		PdiData::make_high();
 		m_state = st_rst_disable;
-
-		m_time_base = m_clock.value();
+		this->schedule(Clock::template us<8>::value);
 	}
 
 	bool tx_ready() const
 	{
-		return (m_state == st_idle || m_state == st_busy) && !m_tx_buffer.full() && m_rx_count == 0;
+		return (m_state == st_idle || m_state == st_busy || m_state == st_set_guard)
+			&& !m_tx_buffer.full() && this->read_count() == 0;
 	}
 
 	bool tx_empty() const
@@ -71,8 +84,9 @@ public:
 		this->write(data, 0, 0);
 	}
 
-	void write(uint8_t data, uint8_t rx_count, uint8_t * rx_buf)
+	void write(uint8_t data, uint16_t rx_count, uint8_t * rx_buf)
 	{
+		this->set_guard_time();
 		while (!this->tx_ready())
 			this->process();
 
@@ -98,14 +112,66 @@ public:
 		}
 	}
 	
-	uint8_t read_count() const
+	// Transmits [data, data + size) through a DMA channel triggered by
+	// the USART's DRE flag, so that the bytes don't cost an interrupt each.
+	// Returns once the last byte has been handed over to the USART,
+	// the buffer may be reused afterwards. As with `write`,
+	// the TXC interrupt finishes the transmission.
+	void write_bulk(uint8_t const * data, uint16_t size)
+	{
+		if (size == 0)
+			return;
+
+		this->set_guard_time();
+		while (!this->tx_ready() || !m_tx_buffer.empty())
+			this->process();
+
+		USARTC0_CTRLA = 0;
+		m_rx_count = 0;
+		m_state = st_busy;
+
+		DMA_CH_t & ch = (&DMA.CH0)[DmaCh];
+		ch.CTRLA = 0;
+		ch.TRIGSRC = DMA_CH_TRIGSRC_USARTC0_DRE_gc;
+		ch.ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+
+		uintptr_t srcaddr = (uintptr_t)data;
+		ch.SRCADDR0 = srcaddr;
+		ch.SRCADDR1 = srcaddr >> 8;
+		ch.SRCADDR2 = 0;
+
+		uintptr_t destaddr = (uintptr_t)&USARTC0_DATA;
+		ch.DESTADDR0 = destaddr;
+		ch.DESTADDR1 = destaddr >> 8;
+		ch.DESTADDR2 = 0;
+
+		ch.TRFCNT = size;
+		USARTC0_STATUS = USART_TXCIF_bm;
+		ch.CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+
+		// The DMA refills the data register within a few cycles of DRE,
+		// well before the shift register runs dry, so TXC only fires
+		// after the last byte.
+		while ((ch.CTRLA & DMA_CH_ENABLE_bm) != 0)
+			this->process();
+
+		USARTC0_CTRLA = USART_TXCINTLVL_HI_gc;
+	}
+
+	// The count is 16-bit and the RXC interrupt decrements it,
+	// so it must be read with interrupts disabled.
+	uint16_t read_count() const
 	{
-		return m_rx_count;
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t res = m_rx_count;
+		SREG = sreg;
+		return res;
 	}
 
 	void cancel_read()
 	{
-		if (m_rx_count)
+		if (this->read_count())
 			this->cancel();
 	}
 
@@ -122,61 +188,65 @@ public:
 		}
 	}
 
-	// Must be called at least every 50us
+	// Drives the activity LED and sends the guard time setting
+	// that `intr_alarm` leaves to the main loop. It need not be
+	// called at any particular rate.
 	void process()
 	{
+		this->set_guard_time();
+
 		switch (m_state)
 		{
-		case st_disabled:
-			break;
-		case st_rst_disable:
-			if (m_clock.value() - m_time_base > Clock::template us<8>::value)
-			{
-				USARTC0_CTRLC = USART_CMODE_SYNCHRONOUS_gc | USART_PMODE_EVEN_gc | USART_SBMODE_bm
-					| USART_CHSIZE_8BIT_gc;
-				USARTC0_CTRLA = 0;
-				USARTC0_CTRLB = USART_TXEN_bm;
-
-				m_state = st_wait_ticks;
-				m_time_base = m_clock.value();
-			}
-			break;
-		case st_wait_ticks:
-			// worst-case scenario is 10kHz programming speed
-			if (m_clock.value() - m_time_base > Clock::template us<1800>::value)
-			{
-				m_state = st_idle;
-				m_rx_count = 0;
-				pdi_stcs(*this, 0x02/*CTRL*/, 0x02/*GUARDTIME_32*/);
-			}
-			break;
 		case st_idle:
 			m_led.off();
 			break;
-		case st_rx_done:
-			m_time_base = m_clock.value();
-			m_state = st_rx_done_wait;
-			//fallthrough
 		case st_rx_done_wait:
-			if (m_clock.value() - m_time_base > Clock::template us<100>::value)
-				m_state = st_idle;
-			//fallthrough
 		case st_busy:
 			m_led.on();
 			break;
+		default:
+			break;
+		}
+	}
+
+	void intr_alarm()
+	{
+		m_clock.cancel_alarm();
+
+		switch (m_state)
+		{
+		case st_rst_disable:
+			USARTC0_CTRLC = USART_CMODE_SYNCHRONOUS_gc | USART_PMODE_EVEN_gc | USART_SBMODE_bm
+				| USART_CHSIZE_8BIT_gc;
+			USARTC0_CTRLA = 0;
+			USARTC0_CTRLB = USART_TXEN_bm;
+
+			m_state = st_wait_ticks;
+
+			// worst-case scenario is 10kHz programming speed
+			this->schedule(Clock::template us<1800>::value);
+			break;
+		case st_wait_ticks:
+			// The interrupt must not wait for the transmitter,
+			// the first write or `process` sets the guard time.
+			m_rx_count = 0;
+			m_state = st_set_guard;
+			break;
+		case st_rx_done_wait:
+			m_state = st_idle;
+			break;
 		case st_unrst:
-			if (m_clock.value() - m_time_base > Clock::template us<100>::value)
-			{
-				PdiClk::make_input();
-				PdiData::make_input();
-				PdiClk::make_noninverted();
-
-				USARTC0_CTRLA = 0;
-				USARTC0_CTRLB = 0;
-				USARTC0_CTRLC = 0;
-
-				m_state = st_disabled;
-			}
+			PdiClk::make_input();
+			PdiData::make_input();
+			PdiClk::make_noninverted();
+
+			USARTC0_CTRLA = 0;
+			USARTC0_CTRLB = 0;
+			USARTC0_CTRLC = 0;
+
+			m_state = st_disabled;
+			break;
+		default:
 			break;
 		}
 	}
@@ -186,15 +256,32 @@ public:
 		return m_state != st_disabled && m_state != st_unrst;
 	}
 
+	// True once `clear` has fully released the lines.
+	bool released() const
+	{
+		return m_state == st_disabled;
+	}
+
+	// Returns the framing, parity and overflow flags collected
+	// since the previous call. Call only while no read is pending.
+	uint8_t take_rx_errors()
+	{
+		uint8_t res = m_rx_errors;
+		m_rx_errors = 0;
+		return res;
+	}
+
 	void intr_rxc()
 	{
+		m_rx_errors |= USARTC0_STATUS & (USART_FERR_bm | USART_BUFOVF_bm | USART_PERR_bm);
 		*m_rx_buf++ = USARTC0_DATA;
 		if (--m_rx_count == 0)
 		{
 			USARTC0_CTRLA = 0;
 			USARTC0_CTRLB = USART_TXEN_bm;
 			PdiData::make_output();
-			m_state = st_rx_done;
+			m_state = st_rx_done_wait;
+			this->schedule(Clock::template us<100>::value);
 		}
 	}
 
@@ -240,14 +327,33 @@ public:
 	uint8_t state() const { return m_state; }
 
 private:
+	void set_guard_time()
+	{
+		if (m_state != st_set_guard)
+			return;
+
+		m_state = st_idle;
+		this->write(0xC2); // STCS CTRL
+		this->write(0x02); // GUARDTIME_32
+	}
+
+	// Raises `intr_alarm` after more than `delay` clock ticks.
+	void schedule(typename Clock::time_type delay)
+	{
+		uint8_t sreg = SREG;
+		cli();
+		m_clock.alarm(m_clock.value() + delay + 1);
+		SREG = sreg;
+	}
+
 	Clock & m_clock;
-	typename Clock::time_type m_time_base;
 	avrlib::buffer<uint8_t, 16> m_tx_buffer;
-	volatile uint8_t m_rx_count;
+	volatile uint16_t m_rx_count;
 	volatile uint8_t * m_rx_buf;
+	volatile uint8_t m_rx_errors;
 	Led m_led;
 
-	enum { st_disabled, st_rst_disable, st_wait_ticks, st_idle, st_rx_done, st_rx_done_wait, st_busy, st_unrst } volatile m_state;
+	enum { st_disabled, st_rst_disable, st_wait_ticks, st_set_guard, st_idle, st_rx_done_wait, st_busy, st_unrst } volatile m_state;
 };
 
 #endif // SHUPITO_FW_COMMON_PDI_HPP
@@ -45,10 +45,7 @@ template <typename Pdi>
 void pdi_key(Pdi & pdi, uint64_t key)
 {
 	pdi.write(0xe0);
-	
-	uint8_t const * ptr = reinterpret_cast<uint8_t const *>(&key);
-	for (uint8_t i = 0; i != 8; ++i)
-		pdi.write(*ptr++);
+	pdi.write_bulk(reinterpret_cast<uint8_t const *>(&key), sizeof key);
 }
 
 template <typename Pdi, typename T>
@@ -73,17 +70,6 @@ void pdi_ld(Pdi & pdi)
 	pdi.write(0x24, 1);
 }
 
-template <typename Pdi>
-void pdi_rep_ld(Pdi & pdi, uint8_t count, uint8_t * buf)
-{
-	if (count)
-	{
-		// REPEAT count-1; LD byte, *ptr++
-		pdi.write(0xa0);
-		pdi.write(count-1);
-		pdi.write(0x24, count, buf);
-	}
-}
 
 template <typename Pdi, typename T>
 void pdi_st(Pdi & pdi, T t)
@@ -100,20 +86,46 @@ void pdi_repeat(Pdi & pdi, T count)
 {
 	pdi.write(0xa0 | (sizeof count - 1));
 
-	uint8_t const * count_ptr = reinterpret_cast<uint8_t const *>(&count_ptr);
+	uint8_t const * count_ptr = reinterpret_cast<uint8_t const *>(&count);
 	for (uint8_t i = 0; i != sizeof count; ++i)
 		pdi.write(*count_ptr++);
 }
 
+template <typename Pdi>
+void pdi_rep_ld(Pdi & pdi, uint16_t count, uint8_t * buf)
+{
+	if (count)
+	{
+		// REPEAT count-1; LD byte, *ptr++
+		if (count > 256)
+			pdi_repeat(pdi, (uint16_t)(count - 1));
+		else
+			pdi_repeat(pdi, (uint8_t)(count - 1));
+		pdi.write(0x24, count, buf);
+	}
+}
+
+template <typename Pdi>
+void pdi_rep_st(Pdi & pdi, uint8_t count, uint8_t const * buf)
+{
+	if (count)
+	{
+		// REPEAT count-1; ST byte, *ptr++; data...
+		pdi_repeat(pdi, (uint8_t)(count - 1));
+		pdi.write(0x64);
+		pdi.write_bulk(buf, count);
+	}
+}
+
 template <typename Pdi, typename Clock, typename Process>
 uint8_t pdi_wait_read(Pdi & pdi, Clock & clock, Process const & process)
 {
 	typename Clock::time_type t = clock.value();
 
-	uint8_t r = pdi.read_count();
+	uint16_t r = pdi.read_count();
 	while (r)
 	{
-		uint8_t new_r = pdi.read_count();
+		uint16_t new_r = pdi.read_count();
 		if (new_r != r)
 		{
 			t = clock.value();
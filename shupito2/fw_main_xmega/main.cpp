@@ -42,6 +42,15 @@ struct timer_xd0
 	static void clear_overflow() { TCD0.INTFLAGS = TC0_OVFIF_bm; }
 	static void tov_interrupt(bool) {}
 	static void clock_source(avrlib::timer_clock_source) {}
+
+	static void alarm(time_type t)
+	{
+		TCD0.CCA = t;
+		TCD0.INTFLAGS = TC0_CCAIF_bm;
+		TCD0.INTCTRLB = TC_CCAINTLVL_MED_gc;
+	}
+
+	static void cancel_alarm() { TCD0.INTCTRLB = 0; }
 };
 typedef timer_xd0 clock_t;
 clock_t clock;
@@ -110,7 +119,18 @@ public:
 	virtual void send_sync(uint8_t cmd, uint8_t const * data, uint8_t size);
 
 private:
-	uint8_t m_buffer[16];
+	// A simple frame has room for commands 0 to 14, command 15
+	// goes out as a chunked frame of a single chunk.
+	static uint8_t frame_size(uint8_t cmd, uint8_t size)
+	{
+		return cmd == 15? size + 4: size + 2;
+	}
+
+	void write_frame(uint8_t cmd, uint8_t const * data, uint8_t size);
+
+	uint8_t m_cmd;
+	uint8_t m_size;
+	uint8_t m_buffer[15];
 };
 
 struct com_inner_writer_t : com_writer_t
@@ -163,6 +183,12 @@ public:
 	void clear();
 	error_t start_master(uint16_t speed_khz, uint8_t mode, bool lsb_first);
 	uint8_t send(uint8_t v);
+
+	// Shifts `len` bytes out of `tx` into `rx`. Unlike on shupito23,
+	// the transfer is done synchronously.
+	void start_transfer(uint8_t const * tx, uint8_t * rx, uint16_t len);
+	bool transfer_done() { return true; }
+
 	void enable_tx();
 	void disable_tx();
 	bool read_raw();
@@ -194,12 +220,13 @@ struct led_holder
 	}
 };
 
-typedef pdi_t<clock_t, pin_buf_rst, pin_buf_pdi, led_holder> my_pdi_t;
+typedef pdi_t<clock_t, pin_buf_rst, pin_buf_pdi, led_holder, 0> my_pdi_t;
 my_pdi_t pdi(clock);
 
 ISR(USARTC0_DRE_vect) { pdi.intr_udre(); }
 ISR(USARTC0_TXC_vect) { pdi.intr_txc(); }
 ISR(USARTC0_RXC_vect) { pdi.intr_rxc(); }
+ISR(TCD0_CCA_vect) { pdi.intr_alarm(); }
 
 struct process_t
 {
@@ -773,6 +800,27 @@ private:
 					com.write(0x00);
 				}
 				break;
+			case 5:
+				// Capabilities: 0x45 1'max_in 1'max_out 1'flags 2'commands
+				// flags: bit 1 -- WRITE takes the blank-page flag
+				//        bit 2 -- WRITE can commit asynchronously
+				//        bit 3 -- PROGEN takes bsel 0xFFFF to pick the PDI clock
+				//        bit 4 -- WRITE can verify the page it has written
+				//        bit 5 -- PROGEN takes bsel 0xFFFF to pick the ISP clock
+				// The serial parser only takes simple frames, hence no bit 0.
+				{
+					uint16_t commands = handler? handler->supported_commands(): 0;
+
+					com.write(0x80);
+					com.write(0x06);
+					com.write(0x45);
+					com.write(com.max_packet_size());
+					com.write(15);
+					com.write(0x3E);
+					com.write(commands);
+					com.write(commands >> 8);
+				}
+				break;
 			}
 
 			return true;
@@ -879,10 +927,11 @@ void process_t::operator()() const
 
 uint8_t * com_writer_t::alloc(uint8_t cmd, uint8_t size)
 {
-	if (!this->tx_reserve(size + 2))
+	if (!this->tx_reserve(frame_size(cmd, size)))
 		return 0;
-	m_buffer[0] = (cmd << 4) | size;
-	return m_buffer + 1;
+	m_cmd = cmd;
+	m_size = size;
+	return m_buffer;
 }
 
 uint8_t * com_writer_t::alloc_sync(uint8_t cmd, uint8_t size)
@@ -898,42 +947,45 @@ uint8_t * com_writer_t::alloc_sync(uint8_t cmd, uint8_t size)
 
 void com_writer_t::commit()
 {
-	this->write(0x80);
-
-	uint8_t size = (m_buffer[0] & 0xf) + 1;
-	for (uint8_t i = 0; i < size; ++i)
-		this->write(m_buffer[i]);
+	this->write_frame(m_cmd, m_buffer, m_size);
 }
 
 bool com_writer_t::send(uint8_t cmd, uint8_t const * data, uint8_t size)
 {
-	if (!this->tx_reserve(size + 2))
+	if (!this->tx_reserve(frame_size(cmd, size)))
 		return false;
 
-	this->write(0x80);
-	this->write((cmd << 4)|size);
-	while (size)
-	{
-		this->write(*data);
-		++data;
-		--size;
-	}
+	this->write_frame(cmd, data, size);
 	return true;
 }
 
 void com_writer_t::send_sync(uint8_t cmd, uint8_t const * data, uint8_t size)
 {
-	while (!this->tx_reserve(size + 2))
+	while (!this->tx_reserve(frame_size(cmd, size)))
 		g_process();
 
+	this->write_frame(cmd, data, size);
+}
+
+void com_writer_t::write_frame(uint8_t cmd, uint8_t const * data, uint8_t size)
+{
 	this->write(0x80);
-	this->write((cmd << 4)|size);
-	while (size)
+	if (cmd == 15)
+	{
+		this->write(0xff);
+		if (size)
+			this->write(size);
+	}
+	else
 	{
-		this->write(*data);
-		++data;
-		--size;
+		this->write((cmd << 4)|size);
 	}
+
+	for (uint8_t i = 0; i < size; ++i)
+		this->write(data[i]);
+
+	if (cmd == 15)
+		this->write(0);
 }
 
 void spi_t::clear()
@@ -977,6 +1029,12 @@ uint8_t spi_t::send(uint8_t v)
 	return USARTC1.DATA;
 }
 
+void spi_t::start_transfer(uint8_t const * tx, uint8_t * rx, uint16_t len)
+{
+	for (; len != 0; --len)
+		*rx++ = this->send(*tx++);
+}
+
 void spi_t::enable_tx()
 {
 	pin_buf_txd::make_low();
@@ -1029,6 +1087,9 @@ int main()
 	TCE0.CTRLB = TC0_CCBEN_bm | TC_WGMODE_FRQ_gc;
 	TCE0.CTRLA = TC_CLKSEL_DIV1_gc;
 
+	// The PDI uses a DMA channel for bulk transfers
+	DMA.CTRL = DMA_ENABLE_bm;
+
 	PMIC.CTRL = PMIC_HILVLEN_bm | PMIC_MEDLVLEN_bm | PMIC_LOLVLEN_bm;
 	sei();
 
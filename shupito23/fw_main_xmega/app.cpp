@@ -18,6 +18,7 @@ static my_pdi_t pdi(clock);
 ISR(USARTC0_DRE_vect) { pdi.intr_udre(); }
 ISR(USARTC0_TXC_vect) { pdi.intr_txc(); }
 ISR(USARTC0_RXC_vect) { pdi.intr_rxc(); }
+ISR(TCE0_CCA_vect) { pdi.intr_alarm(); }
 
 static spi_t spi;
 static usart_t usart;
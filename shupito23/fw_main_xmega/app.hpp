@@ -21,7 +21,9 @@
 #include "../../fw_common/handler_uart.hpp"
 #include "handler_jtag_fast.hpp"
 
-typedef pdi_t<clock_t, pin_aux_rst, pin_pdi, led_holder> my_pdi_t;
+// DMA channels 2 and 3 belong to the USB-UART tunnel, which stays up
+// during PDI sessions. Channels 0 and 1 are only used by ISP and JTAG.
+typedef pdi_t<clock_t, pin_aux_rst, pin_pdi, led_holder, 0> my_pdi_t;
 
 static uint8_t volatile const * sn_calib_indexes[] = {
 	&PRODSIGNATURES_LOTNUM0,
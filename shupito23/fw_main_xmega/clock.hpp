@@ -19,6 +19,15 @@ struct clock_t
 	}
 
 	static time_type value() { return TCE0_CNT; }
+
+	static void alarm(time_type t)
+	{
+		TCE0_CCA = t;
+		TCE0_INTFLAGS = TC0_CCAIF_bm;
+		TCE0_INTCTRLB = TC_CCAINTLVL_MED_gc;
+	}
+
+	static void cancel_alarm() { TCE0_INTCTRLB = 0; }
 };
 
 extern clock_t clock;
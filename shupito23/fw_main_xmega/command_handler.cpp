@@ -1,4 +1,5 @@
 #include "app.hpp"
+#include "usb.h"
 #include "utils.hpp"
 #include "settings.hpp"
 #include "../../fw_common/avrlib/serialize.hpp"
@@ -53,6 +54,29 @@ bool app::handle_packet(uint8_t cmd, uint8_t const * cp, uint8_t size, yb_writer
 			*wbuf++ = 0;
 			w.commit();
 		}
+		else if (size && cp[0] == 5)
+		{
+			// Capabilities: 0x45 1'max_in 1'max_out 1'flags 2'commands
+			// flags: bit 0 -- payloads longer than 15 bytes are accepted
+			//        bit 1 -- WRITE takes the blank-page flag
+			//        bit 2 -- WRITE can commit asynchronously
+			//        bit 3 -- PROGEN takes bsel 0xFFFF to pick the PDI clock
+			//        bit 4 -- WRITE can verify the page it has written
+			//        bit 5 -- PROGEN takes bsel 0xFFFF to pick the ISP clock
+			uint8_t * wbuf = w.alloc(0, 6);
+			if (!wbuf)
+				return false;
+
+			uint16_t commands = m_handler? m_handler->supported_commands(): 0;
+
+			*wbuf++ = 0x45;
+			*wbuf++ = w.max_packet_size();
+			*wbuf++ = sizeof usb_yb_out_packet - 1;
+			*wbuf++ = 0x3F;
+			*wbuf++ = commands;
+			*wbuf++ = commands >> 8;
+			w.commit();
+		}
 
 		break;
 	case 0xa:
@@ -2,6 +2,7 @@
 #include "pins.hpp"
 #include "app.hpp"
 #include "led.hpp"
+#include <avr/interrupt.h>
 
 void spi_t::clear()
 {
@@ -42,6 +43,57 @@ uint8_t spi_t::send(uint8_t v)
 	return USARTC1.DATA;
 }
 
+void spi_t::start_transfer(uint8_t const * tx, uint8_t * rx, uint16_t len)
+{
+	// The receive channel has the higher priority, so that it drains
+	// the two-byte receive buffer before the transmitter can overrun it.
+	uint16_t dataaddr = (uint16_t)&USARTC1_DATA;
+
+	DMA_CH0_SRCADDR0 = dataaddr;
+	DMA_CH0_SRCADDR1 = dataaddr >> 8;
+	DMA_CH0_SRCADDR2 = 0;
+
+	uint16_t rxaddr = (uint16_t)rx;
+	DMA_CH0_DESTADDR0 = rxaddr;
+	DMA_CH0_DESTADDR1 = rxaddr >> 8;
+	DMA_CH0_DESTADDR2 = 0;
+
+	DMA_CH0_TRIGSRC = DMA_CH_TRIGSRC_USARTC1_RXC_gc;
+	DMA_CH0_ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_INC_gc;
+	DMA_CH0_TRFCNT = len;
+	DMA_CH0_CTRLA = DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+
+	uint16_t txaddr = (uint16_t)tx;
+	DMA_CH1_SRCADDR0 = txaddr;
+	DMA_CH1_SRCADDR1 = txaddr >> 8;
+	DMA_CH1_SRCADDR2 = 0;
+
+	DMA_CH1_DESTADDR0 = dataaddr;
+	DMA_CH1_DESTADDR1 = dataaddr >> 8;
+	DMA_CH1_DESTADDR2 = 0;
+
+	DMA_CH1_TRIGSRC = DMA_CH_TRIGSRC_USARTC1_DRE_gc;
+	DMA_CH1_ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+	DMA_CH1_TRFCNT = len;
+	DMA_CH1_CTRLA = DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+
+	led_on();
+
+	cli();
+	DMA_CH0_CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+	DMA_CH1_CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+	sei();
+}
+
+bool spi_t::transfer_done()
+{
+	if (DMA_CH0_CTRLA & DMA_CH_ENABLE_bm)
+		return false;
+
+	led_off();
+	return true;
+}
+
 void spi_t::enable_tx()
 {
 	pin_txd::make_low();
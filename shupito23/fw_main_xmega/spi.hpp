@@ -11,6 +11,14 @@ public:
 	void clear();
 	error_t start_master(uint16_t speed_khz, uint8_t mode, bool lsb_first);
 	uint8_t send(uint8_t v);
+
+	// Shifts out `len` bytes from `tx` and stores the bytes shifted in
+	// to `rx`, using DMA channels 0 and 1. Returns immediately; the buffers
+	// must stay untouched until `transfer_done` returns true. `tx` and `rx`
+	// may be the same buffer, each byte is read before it is overwritten.
+	void start_transfer(uint8_t const * tx, uint8_t * rx, uint16_t len);
+	bool transfer_done();
+
 	void enable_tx();
 	void disable_tx();
 	bool read_raw();